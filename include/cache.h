@@ -0,0 +1,82 @@
+//
+// cache.h - Shared response cache
+// Fully built responses (status line + headers + body) shared by all workers.
+//
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define CACHE_DEFAULT_CAPACITY   (16 * 1024 * 1024)  // bytes of response data
+#define CACHE_DEFAULT_TTL        5                   // seconds an entry is fresh
+#define CACHE_DEFAULT_STALE      30                  // seconds a stale entry may still be served
+#define CACHE_PROTECTED_PERCENT  80                  // share of capacity for the protected segment
+#define CACHE_MAX_ENTRY_PERCENT  12                  // larger responses are served but never stored
+#define CACHE_BUCKETS            1024
+#define CACHE_KEY_MAX            320
+
+typedef enum {
+    CACHE_SEG_NONE,         // loading, or unlinked from the cache
+    CACHE_SEG_PROBATION,    // seen once
+    CACHE_SEG_PROTECTED     // hit at least twice
+} cache_segment_t;
+
+typedef struct cache_entry {
+    char key[CACHE_KEY_MAX];
+    char *data;                 // complete response, NULL if the fill failed
+    size_t len;
+    time_t fetched_at;          // monotonic seconds
+    int refcount;
+    bool loading;               // a leader is building the response
+    bool revalidating;          // a refresh of this stale entry is in progress
+    bool linked;                // reachable from the hash table
+    cache_segment_t segment;
+
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry_t;
+
+typedef struct cache_stats {
+    unsigned long hits;
+    unsigned long stale_hits;
+    unsigned long misses;
+    unsigned long coalesced_waits;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+    size_t capacity;
+} cache_stats_t;
+
+// Builds a complete response into a malloc'd buffer.
+// Returns 1 if the response may be stored, 0 if it must not be stored
+// (error pages), -1 if no response could be built.
+typedef int (*cache_fill_fn)(void *arg, char **data, size_t *len);
+
+int cache_init(size_t capacity, int ttl_seconds, int stale_seconds);
+void cache_destroy(void);
+
+// Returns a referenced entry or NULL if the fill failed. Concurrent misses on
+// the same key run fill exactly once; the other callers wait for its result.
+// *revalidate is set when a stale entry was returned and this caller should
+// refresh it with cache_revalidate() once the response has been sent.
+cache_entry_t *cache_get(const char *key, cache_fill_fn fill, void *arg, bool *revalidate);
+void cache_revalidate(cache_entry_t *stale, cache_fill_fn fill, void *arg);
+void cache_release(cache_entry_t *entry);
+
+// For responses produced outside cache_get (streamed listings): a fresh
+// referenced entry or NULL, and a way to store the result afterwards.
+// cache_put takes ownership of data.
+cache_entry_t *cache_lookup(const char *key);
+void cache_put(const char *key, char *data, size_t len);
+
+// Wraps a malloc'd response that must not be cached (error pages, status
+// output) in a private entry so callers can treat every response alike.
+cache_entry_t *cache_entry_wrap(char *data, size_t len);
+
+void cache_get_stats(cache_stats_t *out);
+
+#endif // CACHE_H
@@ -0,0 +1,55 @@
+//
+// dirlist.h - Streamed directory listings (autoindex)
+// Renders HTML or JSON one buffer at a time, so memory stays constant no
+// matter how many entries the directory holds.
+//
+
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DIRLIST_DENTS_BUFFER  32768     // bytes of raw entries read per syscall
+#define DIRLIST_ENTRY_MAX     2048      // longest rendered entry (escaped name)
+
+typedef enum {
+    DIRLIST_HTML,
+    DIRLIST_JSON
+} dirlist_format_t;
+
+typedef struct dirlist {
+    int fd;
+    void *dir;                  // DIR * where getdents64 is unavailable
+    dirlist_format_t format;
+    char url_path[256];         // request path, ends with '/'
+
+    char *dents;                // raw getdents64 records
+    size_t dents_len;
+    size_t dents_pos;
+
+    char pending[DIRLIST_ENTRY_MAX];    // rendered text that did not fit yet
+    size_t pending_len;
+    size_t pending_pos;
+
+    bool header_done;
+    bool entries_done;
+    bool footer_done;
+    bool first_entry;
+} dirlist_t;
+
+int dirlist_open(dirlist_t *d, const char *fullpath, const char *url_path, dirlist_format_t format);
+
+// Renders the next part of the listing into out.
+// Returns bytes written, 0 once the listing is complete, -1 on error.
+ssize_t dirlist_read(dirlist_t *d, char *out, size_t cap);
+
+void dirlist_close(dirlist_t *d);
+
+const char *dirlist_content_type(dirlist_format_t format);
+
+// Percent-encodes everything but unreserved URL characters
+size_t dirlist_url_escape(char *out, size_t cap, const char *s);
+
+#endif // DIRLIST_H
@@ -5,6 +5,23 @@
 #ifndef HANDLER_H
 #define HANDLER_H
 #include <stddef.h>   // for size_t
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "cache.h"
+#include "dirlist.h"
+
+// A response whose body is produced while it is sent (directory listings).
+// A copy is kept while it stays small so it can be cached once complete.
+typedef struct response_stream {
+    dirlist_t listing;
+    char key[CACHE_KEY_MAX];
+    char *capture;
+    size_t capture_len;
+    size_t capture_cap;
+    bool capture_full;          // too large to cache, copy dropped
+    bool complete;
+} response_stream_t;
 
 
 // Handle a single client connection.
@@ -12,6 +29,29 @@
 // Sprint 2: full HTTP request parsing + file serving
 void handle_connection_stub(int client_file_descriptor);
 
+// Returns the complete HTTP/1.1 response for one request (cached or built
+// on the spot), shared by the HTTP/1 path and HTTP/2 streams. The caller
+// sends it, calls handler_revalidate() if asked to, then cache_release().
+// Returns NULL with *stream set when the body must be streamed instead.
+cache_entry_t *handler_resolve(const char *method, const char *path, bool *revalidate, response_stream_t **stream);
+void handler_revalidate(cache_entry_t *entry, const char *path);
+
+// Admission: returns a 403 for /__trace from anywhere but loopback, a 429
+// when the client is over its request limit (release either like any other
+// entry), or NULL when the request may proceed.
+cache_entry_t *handler_admit(uint32_t client_ip, const char *path);
+// Charges bytes against the client's bandwidth; returns how long to wait (ns)
+uint64_t handler_pace(uint32_t client_ip, const char *path, size_t bytes);
+uint32_t handler_client_ip(int fd);     // IPv4 in host order, 0 if unknown
+// Copies the value of a request header (case-insensitive name, surrounding
+// blanks trimmed) from an HTTP/1 head; false if it is not there.
+bool handler_find_header(const char *head, const char *name, char *out, size_t out_size);
+
+// Body of a streamed 200 response: bytes read, 0 at the end, -1 on error.
+ssize_t handler_stream_read(response_stream_t *stream, char *buf, size_t cap);
+const char *handler_stream_content_type(const response_stream_t *stream);
+void handler_stream_close(response_stream_t *stream);
+
 
 
 
@@ -0,0 +1,48 @@
+//
+// hpack.h - HPACK header compression for HTTP/2 (RFC 7541)
+//
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_MAX_STRING         8192   // longest decoded name or value we accept
+
+typedef struct hpack_entry {
+    char *name;         // name and value share one allocation
+    char *value;
+    size_t name_len;
+    size_t value_len;
+} hpack_entry_t;
+
+// Decoder dynamic table, a ring of entries with newest at head
+typedef struct hpack_table {
+    hpack_entry_t *entries;
+    size_t capacity;    // ring slots
+    size_t head;        // slot of the newest entry
+    size_t count;
+    size_t size;        // RFC 7541 size: sum of name + value + 32
+    size_t max_size;    // current limit set by the encoder
+    size_t settings_max;// limit we advertised in SETTINGS_HEADER_TABLE_SIZE
+} hpack_table_t;
+
+typedef void (*hpack_header_fn)(void *arg, const char *name, size_t name_len,
+                                const char *value, size_t value_len);
+
+int hpack_table_init(hpack_table_t *t, size_t max_size);
+void hpack_table_free(hpack_table_t *t);
+
+// Decodes a complete header block, calling cb for every field in order.
+// Returns 0 on success, -1 on a compression error.
+int hpack_decode(hpack_table_t *t, const uint8_t *block, size_t len,
+                 hpack_header_fn cb, void *arg);
+
+// Appends one field to out without touching any dynamic table: a static
+// table index when name and value match, otherwise a literal that is not
+// indexed. Returns bytes written, or 0 if out is too small.
+size_t hpack_encode_header(uint8_t *out, size_t cap, const char *name, const char *value);
+
+#endif // HPACK_H
@@ -0,0 +1,150 @@
+//
+// http2.h - HTTP/2 over cleartext TCP (h2c)
+// Streams of one connection are answered concurrently by the worker pool.
+//
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "cache.h"
+#include "hpack.h"
+#include "handler.h"
+#include "trace.h"
+
+#define H2_PREFACE              "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN          24
+#define H2_FRAME_HEADER_LEN     9
+#define H2_MAX_STREAMS          100         // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_DEFAULT_WINDOW       65535
+#define H2_MAX_WINDOW           0x7fffffff
+#define H2_MAX_FRAME            16384       // largest frame we accept
+#define H2_MAX_HEADER_BLOCK     65536       // HEADERS + CONTINUATION total
+#define H2_DEFAULT_WEIGHT       16
+#define H2_IDLE_TIMEOUT_MS      30000
+
+// Frame types (RFC 7540 section 6)
+#define H2_DATA           0x0
+#define H2_HEADERS        0x1
+#define H2_PRIORITY       0x2
+#define H2_RST_STREAM     0x3
+#define H2_SETTINGS       0x4
+#define H2_PUSH_PROMISE   0x5
+#define H2_PING           0x6
+#define H2_GOAWAY         0x7
+#define H2_WINDOW_UPDATE  0x8
+#define H2_CONTINUATION   0x9
+
+// Frame flags
+#define H2_FLAG_END_STREAM   0x1
+#define H2_FLAG_ACK          0x1
+#define H2_FLAG_END_HEADERS  0x4
+#define H2_FLAG_PADDED       0x8
+#define H2_FLAG_PRIORITY     0x20
+
+// Error codes
+#define H2_NO_ERROR            0x0
+#define H2_PROTOCOL_ERROR      0x1
+#define H2_INTERNAL_ERROR      0x2
+#define H2_FLOW_CONTROL_ERROR  0x3
+#define H2_STREAM_CLOSED       0x5
+#define H2_FRAME_SIZE_ERROR    0x6
+#define H2_REFUSED_STREAM      0x7
+#define H2_CANCEL              0x8
+#define H2_COMPRESSION_ERROR   0x9
+
+struct h2_conn;
+
+typedef struct h2_stream {
+    uint32_t id;                // 0 marks a free slot
+    struct h2_conn *conn;
+
+    // Request, filled by the connection thread
+    char method[8];
+    char path[256];
+    bool malformed;
+    bool end_stream;            // client finished sending (half-closed remote)
+
+    // Priority (RFC 7540 section 5.3)
+    uint32_t depends_on;
+    int weight;                 // 1..256
+    uint64_t vtime;             // virtual finish time for weighted fair sharing
+
+    // Response, filled by the worker that ran the stream job
+    bool job_pending;
+    bool response_ready;
+    cache_entry_t *entry;
+    int status;
+    char content_type[64];
+    char location[300];
+    char retry_after[16];
+    const char *body;
+    size_t body_len;
+    response_stream_t *stream;  // body of unknown length (listings)
+    char *chunk;                // current piece of the streamed body
+    size_t chunk_len;
+    size_t chunk_pos;
+
+    // Send state, owned by the connection thread
+    bool headers_sent;
+    size_t sent;
+    int64_t window;
+    bool cancelled;
+    bool done;                  // END_STREAM sent or stream reset
+} h2_stream_t;
+
+typedef struct h2_conn {
+    int fd;
+    uint32_t client_ip;         // rate limiting key, host order
+    int wake_pipe[2];           // stream jobs poke the connection thread here
+
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_cap;
+
+    hpack_table_t decoder;
+    uint8_t *header_block;      // HEADERS fragment waiting for CONTINUATION
+    size_t header_block_len;
+    uint32_t header_stream;
+    uint8_t header_flags;
+    bool header_has_priority;
+    uint32_t header_depends_on;
+    int header_weight;
+
+    h2_stream_t streams[H2_MAX_STREAMS];
+    int active_streams;
+    uint32_t last_stream_id;
+    uint64_t vclock;
+
+    int64_t send_window;
+    uint32_t peer_initial_window;
+    uint32_t peer_max_frame;
+    bool goaway;
+    bool need_preface;
+
+    // Between reads the connection is parked with the pool, not a worker
+    uint64_t idle_since_ns;     // last bytes received or sent
+    uint64_t send_after_ns;     // output held back until then (pacing)
+    trace_span_t span;
+
+    pthread_mutex_t mutex;      // guards job_pending/response fields
+    pthread_cond_t jobs_done;
+    int jobs_pending;
+} h2_conn_t;
+
+bool http2_is_preface(const char *buf, size_t len);
+bool http2_is_upgrade(const char *request);
+
+// Both take over the socket and close it when the connection ends. The
+// connection only holds a worker while it has frames to process or send.
+void http2_serve_connection(int fd, const char *initial, size_t initial_len);
+void http2_serve_upgrade(int fd, const char *request, size_t request_len,
+                         const char *method, const char *path);
+
+#endif // HTTP2_H
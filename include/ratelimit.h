@@ -0,0 +1,58 @@
+//
+// ratelimit.h - Per-client rate limiting and bandwidth shaping
+// Token buckets keyed on (client IP, rule), kept in a sharded hash table.
+//
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RATELIMIT_SHARDS            64
+#define RATELIMIT_BUCKETS           256     // hash chains per shard
+#define RATELIMIT_MAX_RULES         16
+#define RATELIMIT_IDLE_SECONDS      60      // idle entries are dropped after this
+#define RATELIMIT_SWEEP_SECONDS     10      // how often a shard looks for idle entries
+
+// Per-IP defaults
+#define RATELIMIT_DEFAULT_RPS       200
+#define RATELIMIT_DEFAULT_BURST     400
+#define RATELIMIT_DEFAULT_BPS       (8 * 1024 * 1024)
+#define RATELIMIT_DEFAULT_BYTE_BURST (1024 * 1024)
+
+typedef struct ratelimit_rule {
+    const char *prefix;         // path prefix; "" matches every request
+    double requests_per_sec;    // 0 = no request limit
+    double request_burst;
+    double bytes_per_sec;       // 0 = no bandwidth limit
+    double byte_burst;
+} ratelimit_rule_t;
+
+typedef struct ratelimit_stats {
+    unsigned long admitted;
+    unsigned long rejected;
+    unsigned long paced;        // sends that had to wait for tokens
+    unsigned long entries;
+    unsigned long evicted;
+} ratelimit_stats_t;
+
+// per_ip applies to every request from one address; path rules are added
+// with ratelimit_add_rule() and apply per (address, prefix).
+int ratelimit_init(const ratelimit_rule_t *per_ip, bool exempt_loopback);
+int ratelimit_add_rule(const ratelimit_rule_t *rule);
+void ratelimit_destroy(void);
+
+// Takes one request token from every matching bucket.
+// Returns 0 if admitted, otherwise the seconds until a retry can succeed.
+int ratelimit_admit(uint32_t ip, const char *path);
+
+// Charges bytes about to be sent. Returns how long the caller must wait
+// (nanoseconds) before sending them; transfers are slowed, never cut.
+uint64_t ratelimit_pace(uint32_t ip, const char *path, size_t bytes);
+void ratelimit_sleep(uint64_t ns);
+
+void ratelimit_get_stats(ratelimit_stats_t *out);
+
+#endif // RATELIMIT_H
@@ -8,12 +8,19 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "trace.h"
 
 #define DEFAULT_THREAD_COUNT 4
 #define MAX_QUEUE_SIZE 256
 
+typedef void (*task_fn)(void *arg);
+
 typedef struct queue_node {
     int client_fd;
+    task_fn task;               // set for tasks, client_fd is unused then
+    void *arg;
+    trace_span_t span;          // timing for the queued client
     struct queue_node *next;
 } queue_node_t;
 
@@ -22,22 +29,52 @@ typedef struct request_queue {
     queue_node_t *tail;
     int size;
     int max_size;
+
+    queue_node_t *task_head;    // tasks run before queued clients
+    queue_node_t *task_tail;
+    int task_count;
+    int idle_workers;           // workers blocked in queue_pop
     
     pthread_mutex_t mutex;
     pthread_cond_t not_empty;   
     pthread_cond_t not_full;    
 } request_queue_t;
 
+// A task waiting for its socket to become readable or for a point in time
+typedef struct deferred_task {
+    task_fn task;
+    void *arg;
+    int fd;                     // run once readable, -1 for a plain timer
+    uint64_t due_ns;            // run at this time regardless, 0 for never
+    int poll_index;             // slot in the waiter's poll set, -1 if none
+    struct deferred_task *next;
+} deferred_task_t;
+
 typedef struct threadpool {
     pthread_t *threads;         
     int thread_count;           
     request_queue_t queue;      
     bool shutdown;              
+
+    pthread_t waiter;           // hands deferred tasks to the queue when due
+    bool waiter_running;
+    int wake_pipe[2];
+    deferred_task_t *deferred;
+    int deferred_count;
+    pthread_mutex_t deferred_mutex;
 } threadpool_t;
 
 
 int threadpool_init(int num_threads);
-int enqueue_client(int client_file_descriptor);
+int enqueue_client(int client_file_descriptor, const trace_span_t *span);
+// Hands fn(arg) to an idle worker. Returns -1 without queueing when no worker
+// is idle, so callers that are themselves workers never wait on each other.
+int threadpool_try_submit(task_fn fn, void *arg);
+// Parks fn(arg) without holding a worker until fd is readable (fd >= 0) or
+// delay_ns has passed (0: no deadline), then runs it ahead of new clients.
+// Returns -1 when the pool is not running; the caller must then carry on
+// itself.
+int threadpool_defer(task_fn fn, void *arg, int fd, uint64_t delay_ns);
 void threadpool_shutdown(void);
 int threadpool_queue_size(void);
 
@@ -0,0 +1,64 @@
+//
+// trace.h - Per-request trace spans
+// Phase timestamps are kept in per-thread ring buffers and exported as
+// Chrome trace JSON (chrome://tracing, Perfetto) on SIGUSR1 or via /__trace.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_RING_SIZE             1024    // spans kept per thread
+#define TRACE_LABEL_MAX             64
+#define TRACE_DEFAULT_SAMPLE_EVERY  100     // record 1 request in N
+#define TRACE_DUMP_FILE             "trace.json"
+#define TRACE_DUMP_SIGNAL           SIGUSR1
+
+typedef enum {
+    TRACE_ACCEPTED,
+    TRACE_ENQUEUED,
+    TRACE_DEQUEUED,
+    TRACE_PARSED,
+    TRACE_FILE_OPENED,          // file opened, or the response found in the cache
+    TRACE_HEADERS_SENT,
+    TRACE_LAST_BYTE,
+    TRACE_PHASES
+} trace_phase_t;
+
+typedef struct trace_span {
+    uint64_t id;
+    bool sampled;
+    uint64_t ts[TRACE_PHASES];  // CLOCK_MONOTONIC ns, 0 = phase not reached
+    char label[TRACE_LABEL_MAX];
+} trace_span_t;
+
+// sample_every 0 turns recording off, 1 records every request. Must run
+// before any other thread starts so they inherit the blocked dump signal.
+int trace_init(unsigned sample_every);
+void trace_destroy(void);
+void trace_set_sampling(unsigned sample_every);
+unsigned trace_get_sampling(void);
+
+// Starts a request's span and stamps TRACE_ACCEPTED. USDT probes (built
+// with make USDT=1) fire for every request; sampling only limits recording.
+void trace_begin(trace_span_t *span);
+void trace_stamp(trace_span_t *span, trace_phase_t phase);
+
+// The request the calling thread is serving. trace_mark() and trace_label()
+// apply to it and do nothing when none is attached; trace_commit() stores
+// it in the thread's ring and detaches it.
+void trace_attach(trace_span_t *span);
+void trace_mark(trace_phase_t phase);
+void trace_label(const char *method, const char *path);
+void trace_commit(void);
+// Moves the attached span into *out and detaches it, for a request that
+// finishes on another thread: attach *out there and commit as usual.
+void trace_detach(trace_span_t *out);
+
+// Writes every recorded span as Chrome trace JSON; returns the span count.
+long trace_dump(FILE *out);
+
+#endif // TRACE_H
@@ -0,0 +1,70 @@
+//
+// upload.h - Streaming request bodies (POST/PUT uploads)
+// Bodies are decoded (Content-Length or chunked) through a fixed buffer and
+// written to a temporary file that is renamed into place once complete.
+//
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define UPLOAD_PATH             "/upload/"      // URL prefix for uploads
+#define UPLOAD_DEFAULT_DIR      "uploads"
+#define UPLOAD_DEFAULT_MAX      (16ull * 1024 * 1024 * 1024)   // bytes per upload
+#define UPLOAD_BUFFER           65536
+#define UPLOAD_LINE_MAX         1024            // chunk-size and trailer lines
+#define UPLOAD_IDLE_TIMEOUT     30              // seconds without body data
+#define UPLOAD_NAME_MAX         200
+
+typedef struct upload_request {
+    bool chunked;
+    bool has_length;
+    uint64_t content_length;
+    bool expect_continue;
+} upload_request_t;
+
+// Decodes one request body from a socket, starting with bytes that were
+// already received together with the headers.
+typedef struct body_reader {
+    int fd;
+    bool chunked;
+    uint64_t remaining;         // left in the body, or in the current chunk
+    bool chunk_end;             // CRLF after a chunk's data still to come
+    bool done;
+    uint64_t total;             // decoded body bytes so far
+    char *buf;                  // received but not yet consumed
+    size_t buf_pos;
+    size_t buf_len;
+} body_reader_t;
+
+int upload_init(const char *dir, uint64_t max_bytes);
+uint64_t upload_max_bytes(void);
+
+// Reads Content-Length, Transfer-Encoding and Expect from the request head.
+// Returns 0, or the HTTP status to refuse the request with.
+int upload_parse_request(const char *head, upload_request_t *req);
+
+int body_reader_init(body_reader_t *r, int fd, const upload_request_t *req,
+                     const char *initial, size_t initial_len);
+// Returns decoded bytes, 0 at the end of the body, -1 on a malformed or
+// truncated body.
+ssize_t body_read(body_reader_t *r, char *out, size_t cap);
+void body_reader_free(body_reader_t *r);
+
+// Stores the body as name in the upload directory. PUT replaces an
+// existing file, POST refuses to. Returns the HTTP status for the reply.
+int upload_receive(int fd, const char *name, bool replace, const upload_request_t *req,
+                   const char *initial, size_t initial_len, uint64_t *stored);
+
+// A fresh name for POSTs to the bare upload path
+void upload_generate_name(char *out, size_t size);
+
+// Names are limited to [A-Za-z0-9._-] without a leading '.', so they can
+// never leave the upload directory or inject into response headers
+bool upload_valid_name(const char *name);
+
+#endif // UPLOAD_H
@@ -0,0 +1,425 @@
+// cache.c - Shared response cache with request coalescing
+//
+// Entries live in a chained hash table and, once loaded, in one of two LRU
+// lists (segmented LRU). New entries start in probation; a second hit
+// promotes them to protected. Eviction takes the probation tail first, so a
+// burst of one-off requests cannot flush the hot set.
+//
+// An entry is freed only when it is both unlinked from the table and no
+// worker holds a reference, so responses are sent without holding the lock.
+
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef struct lru_list {
+    cache_entry_t *head;    // most recently used
+    cache_entry_t *tail;
+    size_t bytes;
+} lru_list_t;
+
+typedef struct response_cache {
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    lru_list_t probation;
+    lru_list_t protected_seg;
+    size_t capacity;
+    size_t protected_max;
+    size_t max_entry;
+    int ttl;
+    int stale;
+    cache_stats_t stats;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t filled;  // broadcast whenever a leader finishes loading
+} response_cache_t;
+
+static response_cache_t cache;
+static bool cache_initialized = false;
+
+static time_t now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned int hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h % CACHE_BUCKETS;
+}
+
+static lru_list_t *segment_list(cache_segment_t segment) {
+    return segment == CACHE_SEG_PROTECTED ? &cache.protected_seg : &cache.probation;
+}
+
+static void lru_remove(cache_entry_t *e) {
+    lru_list_t *list = segment_list(e->segment);
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else list->head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else list->tail = e->lru_prev;
+    list->bytes -= e->len;
+    e->lru_prev = NULL;
+    e->lru_next = NULL;
+    e->segment = CACHE_SEG_NONE;
+}
+
+static void lru_push_front(cache_entry_t *e, cache_segment_t segment) {
+    lru_list_t *list = segment_list(segment);
+    e->segment = segment;
+    e->lru_prev = NULL;
+    e->lru_next = list->head;
+    if (list->head) list->head->lru_prev = e;
+    else list->tail = e;
+    list->head = e;
+    list->bytes += e->len;
+}
+
+static void entry_free(cache_entry_t *e) {
+    free(e->data);
+    free(e);
+}
+
+static cache_entry_t *entry_new(const char *key) {
+    cache_entry_t *e = calloc(1, sizeof(cache_entry_t));
+    if (e == NULL) {
+        perror("[Cache] Failed to allocate entry");
+        return NULL;
+    }
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    e->refcount = 1;
+    return e;
+}
+
+static cache_entry_t *table_lookup(const char *key) {
+    cache_entry_t *e = cache.buckets[hash_key(key)];
+    while (e != NULL && strcmp(e->key, key) != 0) {
+        e = e->hash_next;
+    }
+    return e;
+}
+
+static void table_insert(cache_entry_t *e) {
+    unsigned int b = hash_key(e->key);
+    e->hash_next = cache.buckets[b];
+    cache.buckets[b] = e;
+    e->linked = true;
+}
+
+// Removes an entry from the table and LRU; frees it if nobody holds it.
+static void table_unlink(cache_entry_t *e) {
+    cache_entry_t **pp = &cache.buckets[hash_key(e->key)];
+    while (*pp != NULL && *pp != e) {
+        pp = &(*pp)->hash_next;
+    }
+    if (*pp == e) {
+        *pp = e->hash_next;
+    }
+    e->hash_next = NULL;
+    e->linked = false;
+    if (e->segment != CACHE_SEG_NONE) {
+        lru_remove(e);
+        cache.stats.entries--;
+    }
+    if (e->refcount == 0) {
+        entry_free(e);
+    }
+}
+
+static void rebalance(void) {
+    // Demote protected overflow back to probation, most recent first
+    while (cache.protected_seg.bytes > cache.protected_max && cache.protected_seg.tail) {
+        cache_entry_t *e = cache.protected_seg.tail;
+        lru_remove(e);
+        lru_push_front(e, CACHE_SEG_PROBATION);
+    }
+    while (cache.probation.bytes + cache.protected_seg.bytes > cache.capacity) {
+        cache_entry_t *victim = cache.probation.tail ? cache.probation.tail
+                                                     : cache.protected_seg.tail;
+        if (victim == NULL) {
+            break;
+        }
+        table_unlink(victim);
+        cache.stats.evictions++;
+    }
+    cache.stats.bytes = cache.probation.bytes + cache.protected_seg.bytes;
+}
+
+static void touch(cache_entry_t *e) {
+    lru_remove(e);
+    lru_push_front(e, CACHE_SEG_PROTECTED);
+    rebalance();
+}
+
+// Stores a freshly loaded entry, or unlinks it if it must not be kept.
+static void settle(cache_entry_t *e, int rc, char *data, size_t len, cache_segment_t segment) {
+    e->data = data;
+    e->len = len;
+    e->fetched_at = now_seconds();
+    e->loading = false;
+    if (rc > 0 && len <= cache.max_entry) {
+        lru_push_front(e, segment);
+        cache.stats.entries++;
+        rebalance();
+    } else if (e->linked) {
+        table_unlink(e);
+    }
+}
+
+int cache_init(size_t capacity, int ttl_seconds, int stale_seconds) {
+    if (cache_initialized) {
+        fprintf(stderr, "[Cache] Already initialized\n");
+        return -1;
+    }
+    memset(&cache, 0, sizeof(cache));
+    cache.capacity = capacity;
+    cache.protected_max = capacity / 100 * CACHE_PROTECTED_PERCENT;
+    cache.max_entry = capacity / 100 * CACHE_MAX_ENTRY_PERCENT;
+    cache.ttl = ttl_seconds;
+    cache.stale = stale_seconds;
+    cache.stats.capacity = capacity;
+
+    if (pthread_mutex_init(&cache.mutex, NULL) != 0) {
+        perror("[Cache] Failed to initialize mutex");
+        return -1;
+    }
+    if (pthread_cond_init(&cache.filled, NULL) != 0) {
+        perror("[Cache] Failed to initialize cond var");
+        pthread_mutex_destroy(&cache.mutex);
+        return -1;
+    }
+    cache_initialized = true;
+    printf("[Cache] Initialized with %zu bytes, ttl=%ds, stale=%ds\n",
+           capacity, ttl_seconds, stale_seconds);
+    return 0;
+}
+
+void cache_destroy(void) {
+    if (!cache_initialized) {
+        return;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    for (int b = 0; b < CACHE_BUCKETS; b++) {
+        while (cache.buckets[b] != NULL) {
+            table_unlink(cache.buckets[b]);
+        }
+    }
+    cache_initialized = false;
+    pthread_mutex_unlock(&cache.mutex);
+    pthread_cond_destroy(&cache.filled);
+    pthread_mutex_destroy(&cache.mutex);
+}
+
+cache_entry_t *cache_get(const char *key, cache_fill_fn fill, void *arg, bool *revalidate) {
+    char *data = NULL;
+    size_t len = 0;
+    *revalidate = false;
+
+    if (!cache_initialized) {
+        // No shared cache: build a private, unlinked entry
+        cache_entry_t *e = entry_new(key);
+        if (e == NULL) {
+            return NULL;
+        }
+        if (fill(arg, &e->data, &e->len) < 0) {
+            entry_free(e);
+            return NULL;
+        }
+        return e;
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    cache_entry_t *e = table_lookup(key);
+    if (e != NULL && e->loading) {
+        e->refcount++;
+        cache.stats.coalesced_waits++;
+        while (e->loading) {
+            pthread_cond_wait(&cache.filled, &cache.mutex);
+        }
+        pthread_mutex_unlock(&cache.mutex);
+        if (e->data == NULL) {
+            cache_release(e);
+            return NULL;
+        }
+        return e;
+    }
+    if (e != NULL) {
+        time_t age = now_seconds() - e->fetched_at;
+        if (age <= cache.ttl) {
+            cache.stats.hits++;
+            e->refcount++;
+            touch(e);
+            pthread_mutex_unlock(&cache.mutex);
+            return e;
+        }
+        if (age <= cache.ttl + cache.stale) {
+            cache.stats.stale_hits++;
+            e->refcount++;
+            touch(e);
+            if (!e->revalidating) {
+                e->revalidating = true;
+                *revalidate = true;
+            }
+            pthread_mutex_unlock(&cache.mutex);
+            return e;
+        }
+        table_unlink(e);
+    }
+
+    // Miss: this caller becomes the leader for the key
+    cache.stats.misses++;
+    e = entry_new(key);
+    if (e == NULL) {
+        pthread_mutex_unlock(&cache.mutex);
+        return NULL;
+    }
+    e->loading = true;
+    table_insert(e);
+    pthread_mutex_unlock(&cache.mutex);
+
+    int rc = fill(arg, &data, &len);
+
+    pthread_mutex_lock(&cache.mutex);
+    settle(e, rc, rc < 0 ? NULL : data, rc < 0 ? 0 : len, CACHE_SEG_PROBATION);
+    pthread_cond_broadcast(&cache.filled);
+    pthread_mutex_unlock(&cache.mutex);
+
+    if (e->data == NULL) {
+        cache_release(e);
+        return NULL;
+    }
+    return e;
+}
+
+void cache_revalidate(cache_entry_t *stale, cache_fill_fn fill, void *arg) {
+    char *data = NULL;
+    size_t len = 0;
+
+    if (!cache_initialized) {
+        return;
+    }
+
+    int rc = fill(arg, &data, &len);
+
+    pthread_mutex_lock(&cache.mutex);
+    stale->revalidating = false;
+    if (rc <= 0) {
+        // Keep serving the stale copy until it expires
+        pthread_mutex_unlock(&cache.mutex);
+        free(data);
+        return;
+    }
+    cache_entry_t *fresh = entry_new(stale->key);
+    if (fresh == NULL) {
+        pthread_mutex_unlock(&cache.mutex);
+        free(data);
+        return;
+    }
+    fresh->refcount = 0;
+    cache_segment_t segment = stale->segment != CACHE_SEG_NONE ? stale->segment
+                                                               : CACHE_SEG_PROBATION;
+    cache_entry_t *current = table_lookup(stale->key);
+    if (current != NULL && current->loading) {
+        // A leader is already rebuilding the key; let it win
+        pthread_mutex_unlock(&cache.mutex);
+        entry_free(fresh);
+        free(data);
+        return;
+    }
+    if (current != NULL) {
+        table_unlink(current);
+    }
+    table_insert(fresh);
+    settle(fresh, rc, data, len, segment);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void cache_release(cache_entry_t *entry) {
+    if (entry == NULL) {
+        return;
+    }
+    if (!cache_initialized) {
+        entry_free(entry);
+        return;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    entry->refcount--;
+    bool dead = entry->refcount == 0 && !entry->linked;
+    pthread_mutex_unlock(&cache.mutex);
+    if (dead) {
+        entry_free(entry);
+    }
+}
+
+cache_entry_t *cache_lookup(const char *key) {
+    if (!cache_initialized) {
+        return NULL;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    cache_entry_t *e = table_lookup(key);
+    if (e == NULL || e->loading || now_seconds() - e->fetched_at > cache.ttl) {
+        cache.stats.misses++;
+        pthread_mutex_unlock(&cache.mutex);
+        return NULL;
+    }
+    cache.stats.hits++;
+    e->refcount++;
+    touch(e);
+    pthread_mutex_unlock(&cache.mutex);
+    return e;
+}
+
+void cache_put(const char *key, char *data, size_t len) {
+    if (!cache_initialized) {
+        free(data);
+        return;
+    }
+    cache_entry_t *e = entry_new(key);
+    if (e == NULL) {
+        free(data);
+        return;
+    }
+    e->refcount = 0;
+
+    pthread_mutex_lock(&cache.mutex);
+    cache_entry_t *current = table_lookup(key);
+    if (current != NULL && current->loading) {
+        pthread_mutex_unlock(&cache.mutex);
+        entry_free(e);
+        free(data);
+        return;
+    }
+    if (current != NULL) {
+        table_unlink(current);
+    }
+    table_insert(e);
+    settle(e, 1, data, len, CACHE_SEG_PROBATION);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+cache_entry_t *cache_entry_wrap(char *data, size_t len) {
+    cache_entry_t *e = entry_new("");
+    if (e == NULL) {
+        free(data);
+        return NULL;
+    }
+    e->data = data;
+    e->len = len;
+    return e;
+}
+
+void cache_get_stats(cache_stats_t *out) {
+    if (!cache_initialized) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    *out = cache.stats;
+    pthread_mutex_unlock(&cache.mutex);
+}
@@ -0,0 +1,260 @@
+// dirlist.c - Streamed directory listings
+//
+// On Linux entries come straight from getdents64 into a fixed buffer, which
+// avoids readdir's per-entry bookkeeping; elsewhere readdir is used. Entries
+// are emitted in directory order (no sorting) so nothing has to be held.
+
+#include "dirlist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static size_t html_escape(char *out, size_t cap, const char *s) {
+    size_t n = 0;
+    for (; *s; s++) {
+        const char *rep = NULL;
+        switch (*s) {
+        case '&': rep = "&amp;"; break;
+        case '<': rep = "&lt;"; break;
+        case '>': rep = "&gt;"; break;
+        case '"': rep = "&quot;"; break;
+        case '\'': rep = "&#39;"; break;
+        }
+        size_t len = rep ? strlen(rep) : 1;
+        if (n + len >= cap) break;
+        if (rep) memcpy(out + n, rep, len);
+        else out[n] = *s;
+        n += len;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+size_t dirlist_url_escape(char *out, size_t cap, const char *s) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        bool plain = (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                     (*p >= '0' && *p <= '9') || strchr("-._~", *p) != NULL;
+        if (n + (plain ? 1 : 3) >= cap) break;
+        if (plain) {
+            out[n++] = *p;
+        } else {
+            out[n++] = '%';
+            out[n++] = hex[*p >> 4];
+            out[n++] = hex[*p & 0xf];
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static size_t json_escape(char *out, size_t cap, const char *s) {
+    size_t n = 0;
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        char tmp[8];
+        size_t len;
+        if (*p == '"' || *p == '\\') {
+            tmp[0] = '\\';
+            tmp[1] = *p;
+            len = 2;
+        } else if (*p < 0x20) {
+            len = snprintf(tmp, sizeof(tmp), "\\u%04x", *p);
+        } else {
+            tmp[0] = *p;
+            len = 1;
+        }
+        if (n + len >= cap) break;
+        memcpy(out + n, tmp, len);
+        n += len;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static const char *type_name(unsigned char type) {
+    switch (type) {
+    case DT_DIR: return "dir";
+    case DT_REG: return "file";
+    case DT_LNK: return "link";
+    default:     return "other";
+    }
+}
+
+static void render_header(dirlist_t *d) {
+    // The HTML header carries the path twice, so each copy gets under half the
+    // buffer; an overlong path is cut short rather than overflowing pending
+    char path[DIRLIST_ENTRY_MAX / 2 - 128];
+    int len;
+    if (d->format == DIRLIST_JSON) {
+        json_escape(path, sizeof(path), d->url_path);
+        len = snprintf(d->pending, sizeof(d->pending),
+                       "{\"path\":\"%s\",\"entries\":[", path);
+    } else {
+        html_escape(path, sizeof(path), d->url_path);
+        len = snprintf(d->pending, sizeof(d->pending),
+                       "<!DOCTYPE html>\n<html><head><title>Index of %s</title></head>\n"
+                       "<body><h1>Index of %s</h1>\n<ul>\n"
+                       "<li><a href=\"../\">../</a></li>\n", path, path);
+    }
+    d->pending_len = (len > 0 && (size_t)len < sizeof(d->pending)) ? (size_t)len : 0;
+    d->pending_pos = 0;
+}
+
+static void render_footer(dirlist_t *d) {
+    if (d->format == DIRLIST_JSON) {
+        d->pending_len = snprintf(d->pending, sizeof(d->pending), "]}\n");
+    } else {
+        d->pending_len = snprintf(d->pending, sizeof(d->pending), "</ul>\n</body></html>\n");
+    }
+    d->pending_pos = 0;
+}
+
+static void render_entry(dirlist_t *d, const char *name, unsigned char type) {
+    const char *slash = type == DT_DIR ? "/" : "";
+    int len;
+
+    if (d->format == DIRLIST_JSON) {
+        char esc[DIRLIST_ENTRY_MAX / 2];
+        json_escape(esc, sizeof(esc), name);
+        len = snprintf(d->pending, sizeof(d->pending), "%s{\"name\":\"%s\",\"type\":\"%s\"}",
+                       d->first_entry ? "" : ",", esc, type_name(type));
+    } else {
+        char href[DIRLIST_ENTRY_MAX / 2], text[DIRLIST_ENTRY_MAX / 2];
+        dirlist_url_escape(href, sizeof(href), name);
+        html_escape(text, sizeof(text), name);
+        len = snprintf(d->pending, sizeof(d->pending), "<li><a href=\"%s%s\">%s%s</a></li>\n",
+                       href, slash, text, slash);
+    }
+    d->first_entry = false;
+    d->pending_len = (len > 0 && (size_t)len < sizeof(d->pending)) ? (size_t)len : 0;
+    d->pending_pos = 0;
+}
+
+// Fetches the next entry; returns 1 with name/type set, 0 at end, -1 on error
+static int next_entry(dirlist_t *d, const char **name, unsigned char *type) {
+#ifdef __linux__
+    while (1) {
+        if (d->dents_pos >= d->dents_len) {
+            long n = syscall(SYS_getdents64, d->fd, d->dents, DIRLIST_DENTS_BUFFER);
+            if (n < 0) return -1;
+            if (n == 0) return 0;
+            d->dents_len = n;
+            d->dents_pos = 0;
+        }
+        struct linux_dirent64 *e = (struct linux_dirent64 *)(d->dents + d->dents_pos);
+        d->dents_pos += e->d_reclen;
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        *name = e->d_name;
+        *type = e->d_type;
+        return 1;
+    }
+#else
+    struct dirent *e;
+    while ((e = readdir((DIR *)d->dir)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        *name = e->d_name;
+        *type = e->d_type;
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+int dirlist_open(dirlist_t *d, const char *fullpath, const char *url_path, dirlist_format_t format) {
+    memset(d, 0, sizeof(*d));
+    d->format = format;
+    d->first_entry = true;
+    snprintf(d->url_path, sizeof(d->url_path), "%s", url_path);
+
+    d->fd = open(fullpath, O_RDONLY | O_DIRECTORY);
+    if (d->fd < 0) {
+        return -1;
+    }
+#ifdef __linux__
+    d->dents = malloc(DIRLIST_DENTS_BUFFER);
+    if (d->dents == NULL) {
+        close(d->fd);
+        return -1;
+    }
+#else
+    d->dir = fdopendir(d->fd);
+    if (d->dir == NULL) {
+        close(d->fd);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+ssize_t dirlist_read(dirlist_t *d, char *out, size_t cap) {
+    size_t n = 0;
+
+    while (n < cap) {
+        if (d->pending_pos < d->pending_len) {
+            size_t chunk = d->pending_len - d->pending_pos;
+            if (chunk > cap - n) chunk = cap - n;
+            memcpy(out + n, d->pending + d->pending_pos, chunk);
+            d->pending_pos += chunk;
+            n += chunk;
+            continue;
+        }
+        if (!d->header_done) {
+            render_header(d);
+            d->header_done = true;
+        } else if (!d->entries_done) {
+            const char *name;
+            unsigned char type;
+            int rc = next_entry(d, &name, &type);
+            if (rc < 0) return -1;
+            if (rc == 0) {
+                d->entries_done = true;
+                continue;
+            }
+            render_entry(d, name, type);
+        } else if (!d->footer_done) {
+            render_footer(d);
+            d->footer_done = true;
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+void dirlist_close(dirlist_t *d) {
+#ifdef __linux__
+    free(d->dents);
+    d->dents = NULL;
+    if (d->fd >= 0) close(d->fd);
+#else
+    if (d->dir != NULL) closedir((DIR *)d->dir);
+    d->dir = NULL;
+#endif
+    d->fd = -1;
+}
+
+const char *dirlist_content_type(dirlist_format_t format) {
+    return format == DIRLIST_JSON ? "application/json" : "text/html";
+}
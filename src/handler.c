@@ -4,32 +4,72 @@
 //
 
 #include "handler.h"
+#include "cache.h"
+#include "http2.h"
+#include "threadpool.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "upload.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stddef.h>   // for size_t
 
 #define RECV_BUFFER 4096
+#define STATS_PATH  "/__stats"
+#define TRACE_PATH  "/__trace"
+#define STREAM_CHUNK      16384
+#define CHUNK_PREFIX      16                    // "<hex size>\r\n" in front of a chunk
+#define LISTING_CACHE_MAX (1024 * 1024)         // larger listings are streamed every time
+#define PACE_CHUNK        65536                 // bytes charged to the rate limiter per send
+#ifdef MSG_MORE
+#define SEND_MORE         MSG_MORE              // headers wait for the first body bytes
+#else
+#define SEND_MORE         0
+#endif
+
+#ifdef __APPLE__
+#define STAT_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
 
 
 static int send_all(int fd, const char *buf, size_t len);
+static int send_all_flags(int fd, const char *buf, size_t len, int flags);
 
 static const char *get_mime_type(const char* path);
 
 static void send_http_response( int fd, int status, const char *status_text, const char *content_type, const char *body);
 
-static void serve_file(int fd, const char *path);
+static int build_response(int status, const char *status_text, const char *content_type, const char *body, size_t body_len, char **out, size_t *out_len);
+
+static int build_file_response(void *arg, char **out, size_t *out_len);
+
+static int build_redirect_response(const char *location, char **out, size_t *out_len);
+
+static cache_entry_t *serve_file(const char *key_path, const char *file, bool *revalidate);
+
+static cache_entry_t *serve_path(const char *path, bool *revalidate, response_stream_t **stream);
+
+static cache_entry_t *serve_stats(void);
 
 
 static int send_all(int fd, const char *buf, size_t len){
+    return send_all_flags(fd, buf, len, 0);
+}
+
+static int send_all_flags(int fd, const char *buf, size_t len, int flags){
     size_t total = 0;
 
     while (total < len){
-        ssize_t sent = send(fd, buf+total, len-total, 0); 
+        ssize_t sent = send(fd, buf+total, len-total, flags); 
         if (sent <= 0){
             return -1;
         }
@@ -38,6 +78,29 @@ static int send_all(int fd, const char *buf, size_t len){
     return 0;
 }
 
+bool handler_find_header(const char *head, const char *name, char *out, size_t out_size){
+    size_t name_len = strlen(name);
+    const char *line = strstr(head, "\r\n");
+
+    while (line != NULL && strncmp(line, "\r\n\r\n", 4) != 0) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ' || *v == '\t') v++;
+            size_t n = 0;
+            while (v[n] != '\0' && v[n] != '\r' && n < out_size - 1) {
+                out[n] = v[n];
+                n++;
+            }
+            while (n > 0 && (out[n - 1] == ' ' || out[n - 1] == '\t')) n--;
+            out[n] = '\0';
+            return true;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return false;
+}
+
 static const char *get_mime_type(const char* path){
     const char *ext= strrchr(path, '.');
     if(!ext) return "application/octet-stream";
@@ -65,71 +128,754 @@ static void send_http_response( int fd, int status, const char *status_text, con
     send_all(fd, body, strlen(body));
 }
 
-static void serve_file(int fd, const char *path){
+static int build_response(int status, const char *status_text, const char *content_type, const char *body, size_t body_len, char **out, size_t *out_len){
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+    "HTTP/1.1 %d %s\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n\r\n", status, status_text, content_type, body_len);
+
+    char *response = malloc(header_len + body_len);
+    if (!response){
+        return -1;
+    }
+    memcpy(response, header, header_len);
+    if (body_len > 0){
+        memcpy(response + header_len, body, body_len);
+    }
+
+    *out = response;
+    *out_len = header_len + body_len;
+    return 0;
+}
+
+static int build_error_response(int status, const char *status_text, const char *body, char **out, size_t *out_len){
+    if (build_response(status, status_text, "text/html", body, strlen(body), out, out_len) != 0){
+        return -1;
+    }
+    return 0;   // error pages are never stored in the cache
+}
+
+static int build_limited_response(int retry_after, char **out, size_t *out_len){
+    const char *body = "<h1>429 Too Many Requests</h1>";
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Type: text/html\r\n"
+    "Retry-After: %d\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n\r\n", retry_after, strlen(body));
+
+    *out = malloc(header_len + strlen(body));
+    if (!*out){
+        return -1;
+    }
+    memcpy(*out, header, header_len);
+    memcpy(*out + header_len, body, strlen(body));
+    *out_len = header_len + strlen(body);
+    return 0;
+}
+
+static int build_redirect_response(const char *location, char **out, size_t *out_len){
+    char header[1024];
+    int header_len = snprintf(header, sizeof(header),
+    "HTTP/1.1 301 Moved Permanently\r\n"
+    "Location: %s\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n", location);
+    if (header_len < 0 || (size_t)header_len >= sizeof(header)){
+        return -1;
+    }
+
+    *out = malloc(header_len);
+    if (!*out){
+        return -1;
+    }
+    memcpy(*out, header, header_len);
+    *out_len = header_len;
+    return 0;
+}
 
-    if (strstr(path, "..") != NULL) {
-    send_http_response(fd, 403, "Forbidden", "text/html", "<h1>403 Forbidden</h1>");
-    return;
+// Percent-encodes a decoded path for a header, keeping its '/' separators
+static void escape_path(char *out, size_t cap, const char *path){
+    size_t n = 0;
+    out[0] = '\0';
+    while (*path && n + 1 < cap){
+        if (*path == '/'){
+            out[n++] = '/';
+            out[n] = '\0';
+            path++;
+            continue;
+        }
+        size_t len = strcspn(path, "/");
+        char segment[256];
+        snprintf(segment, sizeof(segment), "%.*s", (int)len, path);
+        n += dirlist_url_escape(out + n, cap - n, segment);
+        path += len;
     }
+}
+
+// cache_fill_fn: reads the file once and builds the full 200 response
+static int build_file_response(void *arg, char **out, size_t *out_len){
+    const char *path = arg;
 
     char fullpath[512];
     snprintf(fullpath, sizeof(fullpath), "%s%s", "public", path);
 
     int file = open(fullpath, O_RDONLY);
     if (file < 0){
-        const char *msg = "<h1>404 Not Found</h1>";
-        send_http_response(fd, 404, "Not Found", "text/html", msg);
-        return;
+        return build_error_response(404, "Not Found", "<h1>404 Not Found</h1>", out, out_len);
     }
+    trace_mark(TRACE_FILE_OPENED);
 
     struct stat standard;
-    if (fstat(file, &standard) < 0)
+    if (fstat(file, &standard) < 0 || (!S_ISREG(standard.st_mode) && !S_ISDIR(standard.st_mode)))
     {
         close(file);
-        const char *msg = "<h1>500 Internal Server Error</h1>";
-        send_http_response(fd, 500, "Internal Server Error", "text/html", msg);
-        return;
+        return build_error_response(500, "Internal Server Error", "<h1>500 Internal Server Error</h1>", out, out_len);
+    }
+
+    if (S_ISDIR(standard.st_mode))
+    {
+        // Directory URLs end in '/' so relative links in listings resolve.
+        // path is decoded, so it is encoded again for the header.
+        close(file);
+        char location[800];
+        escape_path(location, sizeof(location) - 1, path);
+        strcat(location, "/");
+        return build_redirect_response(location, out, out_len);
     }
 
     size_t filesize = standard.st_size;
-    char* buffer = malloc(filesize);
+    const char *mime = get_mime_type(path);
+
+    char header[512];
+    int header_len = snprintf(header, sizeof(header), 
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: %s\r\n"
+    "Content-Length: %zu\r\n"
+    "Connection: close\r\n\r\n", mime, filesize);
+
+    char* buffer = malloc(header_len + filesize);
 
     if (!buffer){
         close(file);
-        const char *msg = "<h1>500 Internal Server Error</h1>";
-        send_http_response(fd, 500, "Internal Server Error", "text/html", msg);
-        return;
+        return build_error_response(500, "Internal Server Error", "<h1>500 Internal Server Error</h1>", out, out_len);
     }
+    memcpy(buffer, header, header_len);
 
-    ssize_t bytes = read(file, buffer, filesize);
+    size_t total = 0;
+    while (total < filesize){
+        ssize_t bytes = read(file, buffer + header_len + total, filesize - total);
+        if (bytes <= 0){
+            break;
+        }
+        total += bytes;
+    }
     close(file);
 
 
-    if (bytes != (ssize_t)filesize){
+    if (total != filesize){
         free(buffer);
-        const char *msg = "<h1>500 Internal Server Error</h1>";
-        send_http_response(fd, 500, "Internal Server Error", "text/html", msg);
+        return build_error_response(500, "Internal Server Error", "<h1>500 Internal Server Error</h1>", out, out_len);
+    }
+
+    *out = buffer;
+    *out_len = header_len + filesize;
+    return 1;
+}
+
+// The cache key covers everything the response depends on. Only the method
+// and path do today; request headers that change the response must be
+// appended here once the handler honours any.
+static void build_cache_key(char *key, size_t size, const char *method, const char *path){
+    snprintf(key, size, "%s %s", method, path);
+}
+
+static int hex_value(char c){
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Splits "/dir/?format=json" into the decoded path and the query string
+static const char *split_query(const char *path, char *url_path, size_t size){
+    const char *q = strchr(path, '?');
+    const char *end = q ? q : path + strlen(path);
+    size_t n = 0;
+
+    for (const char *p = path; p < end && n < size - 1; p++){
+        int hi = (*p == '%' && p + 2 < end) ? hex_value(p[1]) : -1;
+        int lo = (hi >= 0) ? hex_value(p[2]) : -1;
+        if (lo >= 0 && (hi | lo) != 0){
+            url_path[n++] = (char)(hi << 4 | lo);
+            p += 2;
+        } else {
+            url_path[n++] = *p;
+        }
+    }
+    url_path[n] = '\0';
+    return q ? q + 1 : "";
+}
+
+// The file a cached path is built from: directories serve their index.html.
+// Takes the decoded path; decoding it again would turn "%252e%252e" into
+// ".." after the traversal check.
+static void file_for_path(const char *url_path, char *file, size_t size){
+    size_t len = strlen(url_path);
+    if (len > 0 && url_path[len - 1] == '/'){
+        snprintf(file, size, "%sindex.html", url_path);
+    } else {
+        snprintf(file, size, "%s", url_path);
+    }
+}
+
+static cache_entry_t *error_entry(int status, const char *status_text, const char *body){
+    char *data;
+    size_t len;
+    if (build_error_response(status, status_text, body, &data, &len) < 0){
+        return NULL;
+    }
+    return cache_entry_wrap(data, len);
+}
+
+static cache_entry_t *serve_file(const char *key_path, const char *file, bool *revalidate){
+    char key[CACHE_KEY_MAX];
+    build_cache_key(key, sizeof(key), "GET", key_path);
+
+    cache_entry_t *entry = cache_get(key, build_file_response, (void *)file, revalidate);
+    if (!entry){
+        return error_entry(500, "Internal Server Error", "<h1>500 Internal Server Error</h1>");
+    }
+    return entry;
+}
+
+// Listings are cached under the directory mtime, so adding or removing a
+// file changes the key and the next request renders a fresh listing.
+static cache_entry_t *serve_listing(const char *url_path, const char *query, const struct stat *dir, response_stream_t **stream){
+    dirlist_format_t format = strstr(query, "format=json") ? DIRLIST_JSON : DIRLIST_HTML;
+
+    char key[CACHE_KEY_MAX];
+    snprintf(key, sizeof(key), "GET %s %s %ld.%09ld", url_path,
+             format == DIRLIST_JSON ? "json" : "html",
+             (long)dir->st_mtime, (long)STAT_MTIME_NSEC(dir));
+
+    cache_entry_t *entry = cache_lookup(key);
+    if (entry){
+        return entry;
+    }
+
+    char fullpath[512];
+    snprintf(fullpath, sizeof(fullpath), "%s%s", "public", url_path);
+
+    response_stream_t *rs = calloc(1, sizeof(response_stream_t));
+    if (!rs || dirlist_open(&rs->listing, fullpath, url_path, format) != 0){
+        free(rs);
+        return error_entry(500, "Internal Server Error", "<h1>500 Internal Server Error</h1>");
+    }
+    snprintf(rs->key, sizeof(rs->key), "%s", key);
+    *stream = rs;
+    return NULL;
+}
+
+static cache_entry_t *serve_path(const char *path, bool *revalidate, response_stream_t **stream){
+    char url_path[256];
+    const char *query = split_query(path, url_path, sizeof(url_path));
+
+    if (strstr(url_path, "..") != NULL) {
+    return error_entry(403, "Forbidden", "<h1>403 Forbidden</h1>");
+    }
+
+    char file[300], fullpath[512];
+    struct stat st;
+    size_t len = strlen(url_path);
+    if (len == 0 || url_path[len - 1] != '/'){
+        // The cached redirect for a directory is shared by every query, so
+        // requests with one are redirected here to keep it in Location.
+        // The raw path keeps the client's encoding.
+        snprintf(fullpath, sizeof(fullpath), "%s%s", "public", url_path);
+        if (query[0] != '\0' && stat(fullpath, &st) == 0 && S_ISDIR(st.st_mode)){
+            char location[300], *data;
+            size_t data_len;
+            snprintf(location, sizeof(location), "%.*s/?%s", (int)(query - 1 - path), path, query);
+            if (build_redirect_response(location, &data, &data_len) != 0){
+                return error_entry(500, "Internal Server Error", "<h1>500 Internal Server Error</h1>");
+            }
+            return cache_entry_wrap(data, data_len);
+        }
+        return serve_file(url_path, url_path, revalidate);
+    }
+
+    // Directory: index.html wins over a generated listing
+    file_for_path(url_path, file, sizeof(file));
+    snprintf(fullpath, sizeof(fullpath), "%s%s", "public", file);
+    if (stat(fullpath, &st) == 0 && S_ISREG(st.st_mode)){
+        return serve_file(url_path, file, revalidate);
+    }
+
+    snprintf(fullpath, sizeof(fullpath), "%s%s", "public", url_path);
+    if (stat(fullpath, &st) != 0 || !S_ISDIR(st.st_mode)){
+        return error_entry(404, "Not Found", "<h1>404 Not Found</h1>");
+    }
+    return serve_listing(url_path, query, &st, stream);
+}
+
+static cache_entry_t *serve_stats(void){
+    cache_stats_t stats;
+    cache_get_stats(&stats);
+
+    unsigned long lookups = stats.hits + stats.stale_hits + stats.misses + stats.coalesced_waits;
+    double hit_ratio = lookups ? (double)(stats.hits + stats.stale_hits + stats.coalesced_waits) / lookups : 0.0;
+
+    ratelimit_stats_t limits;
+    ratelimit_get_stats(&limits);
+
+    char body[1024];
+    int body_len = snprintf(body, sizeof(body),
+        "cache_hits %lu\n"
+        "cache_stale_hits %lu\n"
+        "cache_misses %lu\n"
+        "cache_coalesced_waits %lu\n"
+        "cache_evictions %lu\n"
+        "cache_entries %lu\n"
+        "cache_bytes %zu\n"
+        "cache_capacity_bytes %zu\n"
+        "cache_hit_ratio %.4f\n"
+        "ratelimit_admitted %lu\n"
+        "ratelimit_rejected %lu\n"
+        "ratelimit_paced_sends %lu\n"
+        "ratelimit_entries %lu\n"
+        "ratelimit_evicted %lu\n",
+        stats.hits, stats.stale_hits, stats.misses, stats.coalesced_waits,
+        stats.evictions, stats.entries, stats.bytes, stats.capacity, hit_ratio,
+        limits.admitted, limits.rejected, limits.paced, limits.entries, limits.evicted);
+
+    char *data;
+    size_t len;
+    if (build_response(200, "OK", "text/plain", body, body_len, &data, &len) != 0){
+        return NULL;
+    }
+    return cache_entry_wrap(data, len);
+}
+
+// /__trace dumps recorded spans as Chrome trace JSON;
+// /__trace?sample=N changes the sampling rate (0 stops recording)
+static cache_entry_t *serve_trace(const char *query){
+    char *body = NULL;
+    size_t body_len = 0;
+    const char *content_type = "application/json";
+    const char *sample = strstr(query, "sample=");
+
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out){
+        return error_entry(500, "Internal Server Error", "<h1>500 Internal Server Error</h1>");
+    }
+    if (sample){
+        trace_set_sampling((unsigned)strtoul(sample + 7, NULL, 10));
+        fprintf(out, "trace_sample_every %u\n", trace_get_sampling());
+        content_type = "text/plain";
+    } else {
+        trace_dump(out);
+    }
+    fclose(out);
+
+    char *data;
+    size_t len;
+    int rc = build_response(200, "OK", content_type, body, body_len, &data, &len);
+    free(body);
+    if (rc != 0){
+        return NULL;
+    }
+    return cache_entry_wrap(data, len);
+}
+
+cache_entry_t *handler_resolve(const char *method, const char *path, bool *revalidate, response_stream_t **stream){
+    *revalidate = false;
+    *stream = NULL;
+
+    if (strcmp(method, "GET") != 0)
+    {
+        return error_entry(405, "Method Not Allowed", "<h1>Method Not Allowed</h1>");
+    }
+
+    if (strcmp(path, STATS_PATH) == 0){
+        return serve_stats();
+    }
+
+    if (strncmp(path, TRACE_PATH, strlen(TRACE_PATH)) == 0 &&
+        (path[strlen(TRACE_PATH)] == '\0' || path[strlen(TRACE_PATH)] == '?')){
+        const char *query = strchr(path, '?');
+        return serve_trace(query ? query + 1 : "");
+    }
+
+    return serve_path(path, revalidate, stream);
+}
+
+void handler_revalidate(cache_entry_t *entry, const char *path){
+    char url_path[256], file[300];
+    split_query(path, url_path, sizeof(url_path));
+    file_for_path(url_path, file, sizeof(file));
+    cache_revalidate(entry, build_file_response, file);
+}
+
+// Rules see the path as it will be resolved: decoded, without the query and
+// with repeated slashes collapsed, so "/%61pi/" or "//api/" cannot slip past
+// an "/api/" rule
+static void limit_path(const char *path, char *out, size_t size){
+    split_query(path, out, size);
+    char *w = out;
+    for (const char *r = out; *r; r++){
+        if (*r != '/' || w == out || w[-1] != '/'){
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+}
+
+cache_entry_t *handler_admit(uint32_t client_ip, const char *path){
+    char url_path[256];
+    limit_path(path, url_path, sizeof(url_path));
+
+    // Trace dumps expose every client's request paths and the sampling
+    // switch costs everyone latency: both are for local operators only
+    if (strcmp(url_path, TRACE_PATH) == 0 && (client_ip >> 24) != 127){
+        return error_entry(403, "Forbidden", "<h1>403 Forbidden</h1>");
+    }
+
+    int retry_after = ratelimit_admit(client_ip, url_path);
+    if (retry_after == 0){
+        return NULL;
+    }
+
+    char *data;
+    size_t len;
+    if (build_limited_response(retry_after, &data, &len) != 0){
+        return NULL;
+    }
+    return cache_entry_wrap(data, len);
+}
+
+uint64_t handler_pace(uint32_t client_ip, const char *path, size_t bytes){
+    char url_path[256];
+    limit_path(path, url_path, sizeof(url_path));
+    return ratelimit_pace(client_ip, url_path, bytes);
+}
+
+uint32_t handler_client_ip(int fd){
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) != 0 || addr.sin_family != AF_INET){
+        return 0;
+    }
+    return ntohl(addr.sin_addr.s_addr);
+}
+
+ssize_t handler_stream_read(response_stream_t *stream, char *buf, size_t cap){
+    ssize_t n = dirlist_read(&stream->listing, buf, cap);
+    if (n == 0){
+        stream->complete = true;
+    }
+    if (n <= 0 || stream->capture_full){
+        return n;
+    }
+
+    // Keep a copy for the cache while the listing stays small
+    if (stream->capture_len + n > LISTING_CACHE_MAX){
+        free(stream->capture);
+        stream->capture = NULL;
+        stream->capture_full = true;
+        return n;
+    }
+    if (stream->capture_len + n > stream->capture_cap){
+        size_t new_cap = stream->capture_cap ? stream->capture_cap * 2 : 16384;
+        while (new_cap < stream->capture_len + n){
+            new_cap *= 2;
+        }
+        char *grown = realloc(stream->capture, new_cap);
+        if (!grown){
+            free(stream->capture);
+            stream->capture = NULL;
+            stream->capture_full = true;
+            return n;
+        }
+        stream->capture = grown;
+        stream->capture_cap = new_cap;
+    }
+    memcpy(stream->capture + stream->capture_len, buf, n);
+    stream->capture_len += n;
+    return n;
+}
+
+const char *handler_stream_content_type(const response_stream_t *stream){
+    return dirlist_content_type(stream->listing.format);
+}
+
+void handler_stream_close(response_stream_t *stream){
+    if (!stream){
         return;
     }
+    if (stream->complete && !stream->capture_full){
+        char *data;
+        size_t len;
+        if (build_response(200, "OK", handler_stream_content_type(stream),
+                           stream->capture ? stream->capture : "", stream->capture_len, &data, &len) == 0){
+            cache_put(stream->key, data, len);
+        }
+    }
+    free(stream->capture);
+    dirlist_close(&stream->listing);
+    free(stream);
+}
 
-    const char *mime = get_mime_type(path);
+// A response sent at the client's bandwidth. Whenever the client is over
+// it, the response is parked with the thread pool until the wait is over,
+// so a throttled download holds no worker while it waits.
+typedef struct paced_response {
+    int fd;
+    uint32_t client_ip;
+    char path[256];
+    cache_entry_t *entry;           // a complete response, or
+    response_stream_t *stream;      // a body sent with chunked encoding
+    bool revalidate;
+    size_t header_len;              // entry: its head goes out on its own
+    bool headers_sent;
+    size_t sent;                    // bytes of entry taken so far
+    bool stream_done;
+    const char *pending;            // slice already charged for, not yet sent
+    size_t pending_len;
+    trace_span_t span;
+    // Room for the chunk-size line in front of the data and CRLF after it
+    char chunk[CHUNK_PREFIX + STREAM_CHUNK + 2];
+} paced_response_t;
+
+// Picks the next slice to send; false once there is nothing left
+static bool paced_next_slice(paced_response_t *p){
+    if (p->entry){
+        if (p->sent >= p->entry->len){
+            return false;
+        }
+        size_t n = p->entry->len - p->sent < PACE_CHUNK ? p->entry->len - p->sent : PACE_CHUNK;
+        if (!p->headers_sent){
+            n = p->header_len;
+        }
+        p->pending = p->entry->data + p->sent;
+        p->pending_len = n;
+        p->sent += n;
+        return true;
+    }
+
+    if (p->stream_done){
+        return false;
+    }
+    ssize_t n = handler_stream_read(p->stream, p->chunk + CHUNK_PREFIX, STREAM_CHUNK);
+    if (n < 0){
+        return false;   // the missing last-chunk tells the client it was cut short
+    }
+    char size_line[CHUNK_PREFIX + 1];
+    int size_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t)n);
+    char *start = p->chunk + CHUNK_PREFIX - size_len;
+    memcpy(start, size_line, size_len);
+    memcpy(p->chunk + CHUNK_PREFIX + n, "\r\n", 2);
+    p->pending = start;
+    p->pending_len = size_len + n + 2;
+    p->stream_done = n == 0;
+    return true;
+}
 
+static void paced_finish(paced_response_t *p){
+    trace_mark(TRACE_LAST_BYTE);
+    handler_stream_close(p->stream);
+    if (p->entry){
+        // Stale-while-revalidate: the client already has its response
+        if (p->revalidate){
+            handler_revalidate(p->entry, p->path);
+        }
+        cache_release(p->entry);
+    }
+    printf("Finished serving client. Closing connection.\n");
+    close(p->fd);
+    trace_commit();
+    free(p);
+}
 
+// task_fn: sends slices until the client runs out of bandwidth, then parks
+static void paced_run(void *arg){
+    paced_response_t *p = arg;
+    trace_attach(&p->span);
+
+    while (1){
+        if (p->pending_len == 0){
+            if (!paced_next_slice(p)){
+                break;
+            }
+            uint64_t wait = handler_pace(p->client_ip, p->path, p->pending_len);
+            if (wait > 0){
+                trace_attach(NULL);
+                if (threadpool_defer(paced_run, p, -1, wait) == 0){
+                    return;     // p belongs to whichever worker resumes it
+                }
+                trace_attach(&p->span);
+                ratelimit_sleep(wait);      // the pool is shutting down
+            }
+        }
+        bool more = !p->headers_sent && p->sent < p->entry->len;
+        if (send_all_flags(p->fd, p->pending, p->pending_len, more ? SEND_MORE : 0) != 0){
+            break;
+        }
+        if (!p->headers_sent){
+            p->headers_sent = true;
+            trace_mark(TRACE_HEADERS_SENT);
+        }
+        p->pending_len = 0;
+    }
+    paced_finish(p);
+}
+
+// Takes over the connection, the entry or stream and the attached span
+static void send_paced(int fd, uint32_t client_ip, const char *path,
+                       cache_entry_t *entry, response_stream_t *stream, bool revalidate){
+    paced_response_t *p = calloc(1, sizeof(paced_response_t));
+    if (!p){
+        perror("Failed to allocate response state");
+        handler_stream_close(stream);
+        cache_release(entry);
+        close(fd);
+        return;
+    }
+    p->fd = fd;
+    p->client_ip = client_ip;
+    snprintf(p->path, sizeof(p->path), "%s", path);
+    p->entry = entry;
+    p->stream = stream;
+    p->revalidate = revalidate;
+
+    if (entry){
+        // The head is everything up to the blank line
+        p->header_len = entry->len;
+        for (size_t i = 0; i + 4 <= entry->len; i++){
+            if (memcmp(entry->data + i, "\r\n\r\n", 4) == 0){
+                p->header_len = i + 4;
+                break;
+            }
+        }
+    }
+    if (stream){
+        // A response of unknown length: chunked transfer encoding
+        char header[256];
+        int header_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Connection: close\r\n\r\n", handler_stream_content_type(stream));
+        if (send_all(fd, header, header_len) != 0){
+            p->stream_done = true;
+        }
+        p->headers_sent = true;
+        trace_mark(TRACE_HEADERS_SENT);
+    }
+    trace_detach(&p->span);
+    paced_run(p);
+}
+
+
+
+static const char *status_text_for(int status){
+    switch (status){
+    case 200: return "OK";
+    case 201: return "Created";
+    case 400: return "Bad Request";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 417: return "Expectation Failed";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 507: return "Insufficient Storage";
+    default:  return "Internal Server Error";
+    }
+}
+
+static void send_upload_response(int fd, int status, const char *location, const char *body){
     char header[512];
-    int header_len = snprintf(header, sizeof(header), 
-    "HTTP/1.1 200 OK\r\n"
-    "Content-Type: %s\r\n"
-    "Content-Length: %zu\r\n"
-    "Connection: close\r\n\r\n", mime, filesize);
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: text/plain\r\n"
+        "%s%s%s"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", status, status_text_for(status),
+        location ? "Location: " : "", location ? location : "", location ? "\r\n" : "",
+        strlen(body));
 
     send_all(fd, header, header_len);
-    send_all(fd, buffer, filesize);
+    send_all(fd, body, strlen(body));
+}
 
-    free(buffer);
+// POST/PUT under UPLOAD_PATH: the body is streamed to disk, never held whole
+static void handle_upload(int fd, const char *method, const char *path, char *buffer, ssize_t bytes){
+    char message[1024];
 
-}
+    // The body must not be read before the whole head has arrived
+    char *head_end = strstr(buffer, "\r\n\r\n");
+    while (!head_end && bytes < RECV_BUFFER - 1){
+        ssize_t n = recv(fd, buffer + bytes, RECV_BUFFER - 1 - bytes, 0);
+        if (n <= 0){
+            return;
+        }
+        bytes += n;
+        buffer[bytes] = '\0';
+        head_end = strstr(buffer, "\r\n\r\n");
+    }
+    if (!head_end){
+        send_upload_response(fd, 431, NULL, "Request headers too large\n");
+        return;
+    }
+    size_t head_len = head_end + 4 - buffer;
+
+    char url_path[256], name[UPLOAD_NAME_MAX + 1];
+    split_query(path, url_path, sizeof(url_path));
+    if (strncmp(url_path, UPLOAD_PATH, strlen(UPLOAD_PATH)) != 0){
+        send_upload_response(fd, 405, NULL, "Uploads go under " UPLOAD_PATH "\n");
+        return;
+    }
+    snprintf(name, sizeof(name), "%s", url_path + strlen(UPLOAD_PATH));
+    if (name[0] == '\0' && strcmp(method, "POST") == 0){
+        upload_generate_name(name, sizeof(name));
+    }
+    if (!upload_valid_name(name)){
+        send_upload_response(fd, 400, NULL, "Invalid upload name\n");
+        return;
+    }
 
+    upload_request_t req;
+    int status = upload_parse_request(buffer, &req);
+    if (status != 0){
+        snprintf(message, sizeof(message), "%s\n", status_text_for(status));
+        send_upload_response(fd, status, NULL, message);
+        return;
+    }
+    if (req.expect_continue){
+        send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    }
 
+    uint64_t stored;
+    status = upload_receive(fd, name, strcmp(method, "PUT") == 0, &req,
+                            buffer + head_len, bytes - head_len, &stored);
+
+    char location[3 * UPLOAD_NAME_MAX + sizeof(UPLOAD_PATH)];
+    size_t prefix_len = strlen(UPLOAD_PATH);
+    memcpy(location, UPLOAD_PATH, prefix_len);
+    dirlist_url_escape(location + prefix_len, sizeof(location) - prefix_len, name);
+    if (status == 200 || status == 201){
+        snprintf(message, sizeof(message), "Stored %llu bytes at %s\n", (unsigned long long)stored, location);
+    } else {
+        snprintf(message, sizeof(message), "%s\n", status_text_for(status));
+    }
+    send_upload_response(fd, status, status == 201 ? location : NULL, message);
+}
 
 void handle_connection_stub(int client_file_descriptor) {
     char buffer[RECV_BUFFER];
@@ -148,6 +894,16 @@ void handle_connection_stub(int client_file_descriptor) {
         return;
     }
 
+    // HTTP/2 with prior knowledge: the client opens with the h2 preface.
+    // The whole connection is traced as one span.
+    if (http2_is_preface(buffer, bytes)) {
+        printf("HTTP/2 connection (prior knowledge)\n");
+        trace_label("h2", "connection");
+        trace_mark(TRACE_PARSED);
+        http2_serve_connection(client_file_descriptor, buffer, bytes);
+        return;
+    }
+
     buffer[bytes] = '\0';
     printf("Received %d bytes from client:\n%s\n", (int)bytes, buffer);
 
@@ -160,27 +916,39 @@ void handle_connection_stub(int client_file_descriptor) {
         return;
     }
 
-    if (strcmp(method, "GET") != 0)
-    {
-        const char *msg = "<h1>Method Not Allowed</h1>";
-        send_http_response(client_file_descriptor, 405, "Method Not Allowed", "text/html", msg);
+    trace_label(method, path);
+    trace_mark(TRACE_PARSED);
 
-        close(client_file_descriptor);
+    if (http2_is_upgrade(buffer)) {
+        printf("HTTP/2 connection (h2c upgrade) for path: %s\n", path);
+        http2_serve_upgrade(client_file_descriptor, buffer, bytes, method, path);
         return;
     }
 
-    if (strcmp(path, "/") == 0){
-        strcpy(path, "/index.html");
+    uint32_t client_ip = handler_client_ip(client_file_descriptor);
+    bool revalidate = false;
+    response_stream_t *stream = NULL;
+    cache_entry_t *entry = handler_admit(client_ip, path);
 
+    if (!entry && (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0)){
+        printf("Receiving upload for path: %s\n", path);
+        handle_upload(client_file_descriptor, method, path, buffer, bytes);
+        trace_mark(TRACE_LAST_BYTE);
+        close(client_file_descriptor);
+        return;
     }
 
     printf("Serving file for path: %s\n", path); 
     
-    serve_file(client_file_descriptor, path);
-
-    printf("Finished serving client. Closing connection.\n");
-
-    close(client_file_descriptor);
+    if (!entry){
+        entry = handler_resolve(method, path, &revalidate, &stream);
+    }
+    trace_mark(TRACE_FILE_OPENED);
+    if (!entry && !stream){
+        close(client_file_descriptor);
+        return;
+    }
+    send_paced(client_file_descriptor, client_ip, path, entry, stream, revalidate);
 }   
 
 
@@ -0,0 +1,486 @@
+// hpack.c - HPACK decoder/encoder (RFC 7541)
+//
+// The decoder keeps a full dynamic table because clients index aggressively.
+// The encoder never indexes: responses here carry only a handful of fields,
+// so literals avoid having to track the peer's table size at all.
+
+#include "hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define STATIC_TABLE_SIZE 61
+
+typedef struct static_field {
+    const char *name;
+    const char *value;
+} static_field_t;
+
+static const static_field_t static_table[STATIC_TABLE_SIZE] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// Huffman code (RFC 7541 Appendix B), symbol 256 (EOS) is 0x3fffffff/30
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+#define HUFFMAN_EOS       256
+#define HUFFMAN_MAX_NODES 512
+
+// Decoding tree: child >= 0 is an inner node, child < 0 is -(symbol + 1)
+static int16_t huffman_tree[HUFFMAN_MAX_NODES][2];
+static int huffman_node_count = 1;
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_insert(int symbol, uint32_t code, int length) {
+    int node = 0;
+    for (int bit = length - 1; bit >= 0; bit--) {
+        int b = (code >> bit) & 1;
+        if (bit == 0) {
+            huffman_tree[node][b] = (int16_t)-(symbol + 1);
+        } else {
+            if (huffman_tree[node][b] == 0) {
+                huffman_tree[node][b] = (int16_t)huffman_node_count++;
+            }
+            node = huffman_tree[node][b];
+        }
+    }
+}
+
+static void huffman_build(void) {
+    for (int s = 0; s < 256; s++) {
+        huffman_insert(s, huffman_codes[s], huffman_lengths[s]);
+    }
+    huffman_insert(HUFFMAN_EOS, 0x3fffffff, 30);
+}
+
+static int huffman_decode(const uint8_t *in, size_t len, char *out, size_t cap, size_t *out_len) {
+    pthread_once(&huffman_once, huffman_build);
+
+    int node = 0;
+    int depth = 0;          // bits consumed since the last full symbol
+    bool all_ones = true;   // padding must be a prefix of EOS
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            depth++;
+            all_ones = all_ones && b;
+            if (next < 0) {
+                int symbol = -next - 1;
+                if (symbol == HUFFMAN_EOS || n >= cap) {
+                    return -1;
+                }
+                out[n++] = (char)symbol;
+                node = 0;
+                depth = 0;
+                all_ones = true;
+            } else if (next == 0) {
+                return -1;
+            } else {
+                node = next;
+            }
+        }
+    }
+    if (depth > 7 || !all_ones) {
+        return -1;
+    }
+    *out_len = n;
+    return 0;
+}
+
+static int decode_integer(const uint8_t **p, const uint8_t *end, int prefix_bits, size_t *value) {
+    if (*p >= end) {
+        return -1;
+    }
+    size_t max_prefix = (1u << prefix_bits) - 1;
+    size_t v = **p & max_prefix;
+    (*p)++;
+    if (v < max_prefix) {
+        *value = v;
+        return 0;
+    }
+    int shift = 0;
+    while (*p < end) {
+        uint8_t b = **p;
+        (*p)++;
+        if (shift > 28) {
+            return -1;
+        }
+        v += (size_t)(b & 0x7f) << shift;
+        shift += 7;
+        if ((b & 0x80) == 0) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int decode_string(const uint8_t **p, const uint8_t *end, char *out, size_t *out_len) {
+    if (*p >= end) {
+        return -1;
+    }
+    bool huffman = (**p & 0x80) != 0;
+    size_t len;
+    if (decode_integer(p, end, 7, &len) != 0 || len > (size_t)(end - *p)) {
+        return -1;
+    }
+    if (huffman) {
+        if (huffman_decode(*p, len, out, HPACK_MAX_STRING, out_len) != 0) {
+            return -1;
+        }
+    } else {
+        if (len > HPACK_MAX_STRING) {
+            return -1;
+        }
+        memcpy(out, *p, len);
+        *out_len = len;
+    }
+    *p += len;
+    return 0;
+}
+
+int hpack_table_init(hpack_table_t *t, size_t max_size) {
+    memset(t, 0, sizeof(*t));
+    t->capacity = max_size / 32 + 1;    // every entry costs at least 32
+    t->entries = calloc(t->capacity, sizeof(hpack_entry_t));
+    if (t->entries == NULL) {
+        perror("[HPACK] Failed to allocate dynamic table");
+        return -1;
+    }
+    t->max_size = max_size;
+    t->settings_max = max_size;
+    return 0;
+}
+
+void hpack_table_free(hpack_table_t *t) {
+    for (size_t i = 0; i < t->count; i++) {
+        free(t->entries[(t->head + t->capacity - i) % t->capacity].name);
+    }
+    free(t->entries);
+    t->entries = NULL;
+    t->count = 0;
+}
+
+static void table_evict_oldest(hpack_table_t *t) {
+    hpack_entry_t *e = &t->entries[(t->head + t->capacity - (t->count - 1)) % t->capacity];
+    t->size -= e->name_len + e->value_len + 32;
+    free(e->name);
+    e->name = NULL;
+    t->count--;
+}
+
+static void table_resize(hpack_table_t *t, size_t max_size) {
+    t->max_size = max_size;
+    while (t->size > t->max_size && t->count > 0) {
+        table_evict_oldest(t);
+    }
+}
+
+static int table_add(hpack_table_t *t, const char *name, size_t name_len,
+                     const char *value, size_t value_len) {
+    size_t entry_size = name_len + value_len + 32;
+    while (t->count > 0 && t->size + entry_size > t->max_size) {
+        table_evict_oldest(t);
+    }
+    if (entry_size > t->max_size) {
+        return 0;   // larger than the whole table: the table is now empty
+    }
+    char *block = malloc(name_len + value_len + 2);
+    if (block == NULL) {
+        return -1;
+    }
+    memcpy(block, name, name_len);
+    block[name_len] = '\0';
+    memcpy(block + name_len + 1, value, value_len);
+    block[name_len + 1 + value_len] = '\0';
+
+    t->head = (t->head + 1) % t->capacity;
+    hpack_entry_t *e = &t->entries[t->head];
+    e->name = block;
+    e->name_len = name_len;
+    e->value = block + name_len + 1;
+    e->value_len = value_len;
+    t->count++;
+    t->size += entry_size;
+    return 0;
+}
+
+// Resolves a 1-based index across the static and dynamic tables
+static int table_lookup(const hpack_table_t *t, size_t index,
+                        const char **name, size_t *name_len,
+                        const char **value, size_t *value_len) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= STATIC_TABLE_SIZE) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= t->count) {
+        return -1;
+    }
+    const hpack_entry_t *e = &t->entries[(t->head + t->capacity - index) % t->capacity];
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+int hpack_decode(hpack_table_t *t, const uint8_t *block, size_t len,
+                 hpack_header_fn cb, void *arg) {
+    const uint8_t *p = block;
+    const uint8_t *end = block + len;
+    char *name_buf = malloc(HPACK_MAX_STRING);
+    char *value_buf = malloc(HPACK_MAX_STRING);
+    int rc = -1;
+    bool fields_seen = false;
+
+    if (name_buf == NULL || value_buf == NULL) {
+        goto done;
+    }
+
+    while (p < end) {
+        uint8_t first = *p;
+        size_t index;
+
+        if (first & 0x80) {
+            // Indexed header field
+            const char *name, *value;
+            size_t name_len, value_len;
+            if (decode_integer(&p, end, 7, &index) != 0 ||
+                table_lookup(t, index, &name, &name_len, &value, &value_len) != 0) {
+                goto done;
+            }
+            cb(arg, name, name_len, value, value_len);
+            fields_seen = true;
+        } else if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed before any field
+            size_t new_size;
+            if (fields_seen || decode_integer(&p, end, 5, &new_size) != 0 ||
+                new_size > t->settings_max) {
+                goto done;
+            }
+            table_resize(t, new_size);
+        } else {
+            // Literal: with incremental indexing (01), without (0000) or never (0001)
+            bool indexing = (first & 0xc0) == 0x40;
+            int prefix = indexing ? 6 : 4;
+            const char *name = name_buf;
+            size_t name_len, value_len;
+
+            if (decode_integer(&p, end, prefix, &index) != 0) {
+                goto done;
+            }
+            if (index == 0) {
+                if (decode_string(&p, end, name_buf, &name_len) != 0) {
+                    goto done;
+                }
+            } else {
+                const char *ignored;
+                size_t ignored_len;
+                if (table_lookup(t, index, &name, &name_len, &ignored, &ignored_len) != 0) {
+                    goto done;
+                }
+                // Copy: adding to the table below may evict the entry we point at
+                memcpy(name_buf, name, name_len);
+                name = name_buf;
+            }
+            if (decode_string(&p, end, value_buf, &value_len) != 0) {
+                goto done;
+            }
+            if (indexing && table_add(t, name, name_len, value_buf, value_len) != 0) {
+                goto done;
+            }
+            cb(arg, name, name_len, value_buf, value_len);
+            fields_seen = true;
+        }
+    }
+    rc = 0;
+
+done:
+    free(name_buf);
+    free(value_buf);
+    return rc;
+}
+
+static size_t encode_integer(uint8_t *out, size_t cap, uint8_t first, int prefix_bits, size_t value) {
+    size_t max_prefix = (1u << prefix_bits) - 1;
+    size_t n = 0;
+    if (cap == 0) {
+        return 0;
+    }
+    if (value < max_prefix) {
+        out[n++] = first | (uint8_t)value;
+        return n;
+    }
+    out[n++] = first | (uint8_t)max_prefix;
+    value -= max_prefix;
+    while (value >= 0x80) {
+        if (n >= cap) return 0;
+        out[n++] = (uint8_t)(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n >= cap) return 0;
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+static size_t encode_string(uint8_t *out, size_t cap, const char *s) {
+    size_t len = strlen(s);
+    size_t n = encode_integer(out, cap, 0x00, 7, len);
+    if (n == 0 || n + len > cap) {
+        return 0;
+    }
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+size_t hpack_encode_header(uint8_t *out, size_t cap, const char *name, const char *value) {
+    size_t name_index = 0;
+    for (size_t i = 0; i < STATIC_TABLE_SIZE; i++) {
+        if (strcmp(static_table[i].name, name) != 0) {
+            continue;
+        }
+        if (strcmp(static_table[i].value, value) == 0) {
+            return encode_integer(out, cap, 0x80, 7, i + 1);
+        }
+        if (name_index == 0) {
+            name_index = i + 1;
+        }
+    }
+
+    size_t n = encode_integer(out, cap, 0x00, 4, name_index);
+    if (n == 0) {
+        return 0;
+    }
+    if (name_index == 0) {
+        size_t s = encode_string(out + n, cap - n, name);
+        if (s == 0) return 0;
+        n += s;
+    }
+    size_t s = encode_string(out + n, cap - n, value);
+    if (s == 0) return 0;
+    return n + s;
+}
@@ -0,0 +1,1183 @@
+// http2.c - HTTP/2 (h2c) connection handling
+//
+// One worker at a time is the connection thread: it alone reads frames and
+// writes to the socket. Each complete request is turned into a stream job
+// that an idle worker resolves through the shared response cache; if no
+// worker is idle the job runs inline. Finished jobs wake the connection
+// thread through a pipe, which then interleaves DATA frames by stream weight
+// within the peer's flow-control windows. Once only the client can give it
+// more to do, the connection is parked with the pool and the worker freed.
+
+#include "http2.h"
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#define H2_OUT_FLUSH     65536   // flush the write buffer past this size
+#define H2_POLL_MS       1000
+
+typedef struct h2_request {
+    char method[8];
+    char path[256];
+    bool has_method;
+    bool has_path;
+    bool regular_seen;
+    bool malformed;
+} h2_request_t;
+
+static uint32_t get_u24(const uint8_t *p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int send_all(int fd, const uint8_t *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t sent = send(fd, buf + total, len - total, 0);
+        if (sent <= 0) {
+            return -1;
+        }
+        total += sent;
+    }
+    return 0;
+}
+
+// ================================
+// Output buffering
+// ================================
+
+static int out_append(h2_conn_t *c, const void *data, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + len) {
+            cap *= 2;
+        }
+        uint8_t *grown = realloc(c->out, cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+static int frame_write(h2_conn_t *c, uint8_t type, uint8_t flags, uint32_t stream_id,
+                       const void *payload, size_t len) {
+    uint8_t header[H2_FRAME_HEADER_LEN];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put_u32(header + 5, stream_id & 0x7fffffff);
+    if (out_append(c, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    return len ? out_append(c, payload, len) : 0;
+}
+
+static int conn_flush(h2_conn_t *c) {
+    if (c->out_len == 0) {
+        return 0;
+    }
+    int rc = send_all(c->fd, c->out, c->out_len);
+    c->out_len = 0;
+    if (rc == 0) {
+        c->idle_since_ns = now_ns();
+    }
+    return rc;
+}
+
+// Sends GOAWAY and reports failure so the caller tears the connection down
+static int conn_error(h2_conn_t *c, uint32_t code) {
+    uint8_t payload[8];
+    put_u32(payload, c->last_stream_id);
+    put_u32(payload + 4, code);
+    frame_write(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    conn_flush(c);
+    fprintf(stderr, "[HTTP2] Connection error 0x%x, closing\n", code);
+    return -1;
+}
+
+static int send_window_update(h2_conn_t *c, uint32_t stream_id, uint32_t increment) {
+    uint8_t payload[4];
+    put_u32(payload, increment);
+    return frame_write(c, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+// ================================
+// Streams
+// ================================
+
+static h2_stream_t *stream_find(h2_conn_t *c, uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static h2_stream_t *stream_alloc(h2_conn_t *c, uint32_t id) {
+    h2_stream_t *s = stream_find(c, 0);
+    if (s == NULL) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->conn = c;
+    s->weight = H2_DEFAULT_WEIGHT;
+    s->window = c->peer_initial_window;
+    s->vtime = c->vclock;
+    c->active_streams++;
+    return s;
+}
+
+// Frees a finished stream once no worker is still using it
+static void stream_retire(h2_conn_t *c, h2_stream_t *s) {
+    pthread_mutex_lock(&c->mutex);
+    bool busy = s->job_pending;
+    pthread_mutex_unlock(&c->mutex);
+    if (busy) {
+        return;
+    }
+    cache_release(s->entry);
+    handler_stream_close(s->stream);
+    free(s->chunk);
+    memset(s, 0, sizeof(*s));
+    c->active_streams--;
+}
+
+static int stream_reset(h2_conn_t *c, h2_stream_t *s, uint32_t stream_id, uint32_t code) {
+    uint8_t payload[4];
+    put_u32(payload, code);
+    if (frame_write(c, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload)) != 0) {
+        return -1;
+    }
+    if (s != NULL) {
+        s->cancelled = true;
+        s->done = true;
+        stream_retire(c, s);
+    }
+    return 0;
+}
+
+static void conn_wake(h2_conn_t *c) {
+    char byte = 1;
+    if (write(c->wake_pipe[1], &byte, 1) < 0 && errno != EAGAIN) {
+        perror("[HTTP2] Failed to wake connection");
+    }
+}
+
+static void copy_header_value(char *out, size_t size, const char *v, const char *end) {
+    size_t n = 0;
+    while (v + n < end && v[n] != '\r' && n < size - 1) {
+        n++;
+    }
+    memcpy(out, v, n);
+    out[n] = '\0';
+}
+
+// Splits the cached HTTP/1.1 response into status, content type and body
+static void parse_response(h2_stream_t *s, const cache_entry_t *e) {
+    const char *data = e->data;
+    size_t len = e->len;
+
+    s->status = (len > 12) ? atoi(data + 9) : 500;
+    snprintf(s->content_type, sizeof(s->content_type), "application/octet-stream");
+    s->location[0] = '\0';
+    s->retry_after[0] = '\0';
+    s->body = data + len;
+    s->body_len = 0;
+
+    for (size_t i = 0; i + 3 < len; i++) {
+        if (memcmp(data + i, "\r\n\r\n", 4) == 0) {
+            s->body = data + i + 4;
+            s->body_len = len - i - 4;
+            break;
+        }
+        if (memcmp(data + i, "\r\nContent-Type: ", 16) == 0) {
+            copy_header_value(s->content_type, sizeof(s->content_type), data + i + 16, data + len);
+        } else if (i + 12 < len && memcmp(data + i, "\r\nLocation: ", 12) == 0) {
+            copy_header_value(s->location, sizeof(s->location), data + i + 12, data + len);
+        } else if (i + 15 < len && memcmp(data + i, "\r\nRetry-After: ", 15) == 0) {
+            copy_header_value(s->retry_after, sizeof(s->retry_after), data + i + 15, data + len);
+        }
+    }
+}
+
+// Runs on a pool worker (or inline): resolves one request
+static void stream_job(void *arg) {
+    h2_stream_t *s = arg;
+    h2_conn_t *c = s->conn;
+    char method[8], path[256];
+    bool revalidate;
+    response_stream_t *stream;
+
+    memcpy(method, s->method, sizeof(method));
+    memcpy(path, s->path, sizeof(path));
+
+    revalidate = false;
+    stream = NULL;
+    cache_entry_t *entry = handler_admit(c->client_ip, path);
+    if (entry == NULL) {
+        entry = handler_resolve(method, path, &revalidate, &stream);
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    s->entry = entry;
+    s->stream = stream;
+    if (entry != NULL) {
+        parse_response(s, entry);
+    } else if (stream != NULL) {
+        s->status = 200;
+        snprintf(s->content_type, sizeof(s->content_type), "%s", handler_stream_content_type(stream));
+    }
+    s->response_ready = true;
+    pthread_mutex_unlock(&c->mutex);
+    conn_wake(c);
+
+    // Stale-while-revalidate: the stream holds a reference until we are done
+    if (entry != NULL && revalidate) {
+        handler_revalidate(entry, path);
+    }
+
+    // Woken under the lock: once jobs_pending drops, c may be freed
+    pthread_mutex_lock(&c->mutex);
+    s->job_pending = false;
+    c->jobs_pending--;
+    conn_wake(c);
+    pthread_cond_broadcast(&c->jobs_done);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static void stream_dispatch(h2_conn_t *c, h2_stream_t *s) {
+    pthread_mutex_lock(&c->mutex);
+    s->job_pending = true;
+    c->jobs_pending++;
+    pthread_mutex_unlock(&c->mutex);
+
+    if (threadpool_try_submit(stream_job, s) != 0) {
+        stream_job(s);
+    }
+}
+
+// ================================
+// Header blocks
+// ================================
+
+static void collect_header(void *arg, const char *name, size_t name_len,
+                           const char *value, size_t value_len) {
+    h2_request_t *req = arg;
+
+    for (size_t i = 0; i < name_len; i++) {
+        if (isupper((unsigned char)name[i])) {
+            req->malformed = true;
+        }
+    }
+
+    if (name_len > 0 && name[0] == ':') {
+        if (req->regular_seen) {
+            req->malformed = true;
+        } else if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+            if (req->has_method || value_len >= sizeof(req->method)) {
+                req->malformed = true;
+            } else {
+                memcpy(req->method, value, value_len);
+                req->method[value_len] = '\0';
+                req->has_method = true;
+            }
+        } else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+            if (req->has_path || value_len == 0 || value_len >= sizeof(req->path)) {
+                req->malformed = true;
+            } else {
+                memcpy(req->path, value, value_len);
+                req->path[value_len] = '\0';
+                req->has_path = true;
+            }
+        }
+        return;
+    }
+
+    req->regular_seen = true;
+    if ((name_len == 10 && memcmp(name, "connection", 10) == 0) ||
+        (name_len == 17 && memcmp(name, "transfer-encoding", 17) == 0)) {
+        req->malformed = true;
+    }
+}
+
+static void set_priority(h2_stream_t *s, uint32_t depends_on, int weight) {
+    s->depends_on = depends_on;
+    s->weight = weight;
+}
+
+static int process_header_block(h2_conn_t *c, uint32_t stream_id, uint8_t flags,
+                                const uint8_t *block, size_t len) {
+    h2_request_t req;
+    memset(&req, 0, sizeof(req));
+
+    // Always decode, even for refused streams, to keep the table in sync
+    if (hpack_decode(&c->decoder, block, len, collect_header, &req) != 0) {
+        return conn_error(c, H2_COMPRESSION_ERROR);
+    }
+
+    h2_stream_t *s = stream_find(c, stream_id);
+    if (s != NULL) {
+        // Trailers: must close the stream
+        if (s->end_stream) {
+            return stream_reset(c, s, stream_id, H2_STREAM_CLOSED);
+        }
+        if (!(flags & H2_FLAG_END_STREAM)) {
+            return stream_reset(c, s, stream_id, H2_PROTOCOL_ERROR);
+        }
+        s->end_stream = true;
+        stream_dispatch(c, s);
+        return 0;
+    }
+
+    if ((stream_id & 1) == 0 || stream_id <= c->last_stream_id) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    c->last_stream_id = stream_id;
+
+    if (c->goaway) {
+        return 0;
+    }
+    if (c->active_streams >= H2_MAX_STREAMS) {
+        return stream_reset(c, NULL, stream_id, H2_REFUSED_STREAM);
+    }
+    if (req.malformed || !req.has_method || !req.has_path) {
+        return stream_reset(c, NULL, stream_id, H2_PROTOCOL_ERROR);
+    }
+    if (c->header_has_priority && c->header_depends_on == stream_id) {
+        return stream_reset(c, NULL, stream_id, H2_PROTOCOL_ERROR);
+    }
+
+    s = stream_alloc(c, stream_id);
+    memcpy(s->method, req.method, sizeof(s->method));
+    memcpy(s->path, req.path, sizeof(s->path));
+    if (c->header_has_priority) {
+        set_priority(s, c->header_depends_on, c->header_weight);
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        s->end_stream = true;
+        stream_dispatch(c, s);
+    }
+    return 0;
+}
+
+// ================================
+// Frame handlers
+// ================================
+
+// Strips padding; returns -1 if the padding is longer than the frame
+static int strip_padding(uint8_t flags, const uint8_t **payload, size_t *len) {
+    if (!(flags & H2_FLAG_PADDED)) {
+        return 0;
+    }
+    if (*len < 1) {
+        return -1;
+    }
+    size_t pad = (*payload)[0];
+    if (pad >= *len) {
+        return -1;
+    }
+    *payload += 1;
+    *len -= 1 + pad;
+    return 0;
+}
+
+static int apply_settings(h2_conn_t *c, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = (p[i] << 8) | p[i + 1];
+        uint32_t value = get_u32(p + i + 2);
+
+        switch (id) {
+        case 0x2:   // ENABLE_PUSH: we never push
+            if (value > 1) {
+                return conn_error(c, H2_PROTOCOL_ERROR);
+            }
+            break;
+        case 0x4: { // INITIAL_WINDOW_SIZE applies to every open stream
+            if (value > H2_MAX_WINDOW) {
+                return conn_error(c, H2_FLOW_CONTROL_ERROR);
+            }
+            int64_t delta = (int64_t)value - c->peer_initial_window;
+            for (int s = 0; s < H2_MAX_STREAMS; s++) {
+                if (c->streams[s].id != 0) {
+                    c->streams[s].window += delta;
+                    if (c->streams[s].window > H2_MAX_WINDOW) {
+                        return conn_error(c, H2_FLOW_CONTROL_ERROR);
+                    }
+                }
+            }
+            c->peer_initial_window = value;
+            break;
+        }
+        case 0x5:   // MAX_FRAME_SIZE
+            if (value < 16384 || value > 16777215) {
+                return conn_error(c, H2_PROTOCOL_ERROR);
+            }
+            c->peer_max_frame = value;
+            break;
+        default:    // HEADER_TABLE_SIZE (we never index), others ignored
+            break;
+        }
+    }
+    return 0;
+}
+
+static int handle_data(h2_conn_t *c, uint8_t flags, uint32_t stream_id,
+                       const uint8_t *payload, size_t len) {
+    if (stream_id == 0) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    // Request bodies are not used; return the credit right away
+    if (len > 0 && send_window_update(c, 0, len) != 0) {
+        return -1;
+    }
+    size_t frame_len = len;
+    if (strip_padding(flags, &payload, &len) != 0) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+
+    h2_stream_t *s = stream_find(c, stream_id);
+    if (s == NULL || s->end_stream) {
+        if (stream_id > c->last_stream_id) {
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        }
+        return stream_reset(c, s, stream_id, H2_STREAM_CLOSED);
+    }
+    if (flags & H2_FLAG_END_STREAM) {
+        s->end_stream = true;
+        stream_dispatch(c, s);
+    } else if (frame_len > 0 && send_window_update(c, stream_id, frame_len) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int handle_headers(h2_conn_t *c, uint8_t flags, uint32_t stream_id,
+                          const uint8_t *payload, size_t len) {
+    if (stream_id == 0) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    if (strip_padding(flags, &payload, &len) != 0) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+
+    c->header_has_priority = (flags & H2_FLAG_PRIORITY) != 0;
+    if (c->header_has_priority) {
+        if (len < 5) {
+            return conn_error(c, H2_FRAME_SIZE_ERROR);
+        }
+        c->header_depends_on = get_u32(payload) & 0x7fffffff;
+        c->header_weight = payload[4] + 1;
+        payload += 5;
+        len -= 5;
+    }
+
+    if (flags & H2_FLAG_END_HEADERS) {
+        return process_header_block(c, stream_id, flags, payload, len);
+    }
+
+    memcpy(c->header_block, payload, len);
+    c->header_block_len = len;
+    c->header_stream = stream_id;
+    c->header_flags = flags;
+    return 0;
+}
+
+static int handle_continuation(h2_conn_t *c, uint8_t flags, uint32_t stream_id,
+                               const uint8_t *payload, size_t len) {
+    if (c->header_stream == 0 || stream_id != c->header_stream) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    if (c->header_block_len + len > H2_MAX_HEADER_BLOCK) {
+        return conn_error(c, H2_INTERNAL_ERROR);
+    }
+    memcpy(c->header_block + c->header_block_len, payload, len);
+    c->header_block_len += len;
+
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+        return 0;
+    }
+    c->header_stream = 0;
+    return process_header_block(c, stream_id, c->header_flags,
+                                c->header_block, c->header_block_len);
+}
+
+static int handle_priority(h2_conn_t *c, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    if (stream_id == 0) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    if (len != 5) {
+        return stream_reset(c, stream_find(c, stream_id), stream_id, H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t depends_on = get_u32(payload) & 0x7fffffff;
+    h2_stream_t *s = stream_find(c, stream_id);
+    if (depends_on == stream_id) {
+        return stream_reset(c, s, stream_id, H2_PROTOCOL_ERROR);
+    }
+    if (s != NULL) {
+        set_priority(s, depends_on, payload[4] + 1);
+    }
+    return 0;
+}
+
+static int handle_rst_stream(h2_conn_t *c, uint32_t stream_id, size_t len) {
+    if (len != 4) {
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+    }
+    if (stream_id == 0 || stream_id > c->last_stream_id) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    h2_stream_t *s = stream_find(c, stream_id);
+    if (s != NULL) {
+        s->cancelled = true;
+        s->done = true;
+        stream_retire(c, s);
+    }
+    return 0;
+}
+
+static int handle_settings(h2_conn_t *c, uint8_t flags, uint32_t stream_id,
+                           const uint8_t *payload, size_t len) {
+    if (stream_id != 0) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    if (flags & H2_FLAG_ACK) {
+        return len == 0 ? 0 : conn_error(c, H2_FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0) {
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+    }
+    if (apply_settings(c, payload, len) != 0) {
+        return -1;
+    }
+    return frame_write(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static int handle_ping(h2_conn_t *c, uint8_t flags, uint32_t stream_id,
+                       const uint8_t *payload, size_t len) {
+    if (len != 8) {
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+    }
+    if (stream_id != 0) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+    if (flags & H2_FLAG_ACK) {
+        return 0;
+    }
+    return frame_write(c, H2_PING, H2_FLAG_ACK, 0, payload, len);
+}
+
+static int handle_window_update(h2_conn_t *c, uint32_t stream_id, const uint8_t *payload, size_t len) {
+    if (len != 4) {
+        return conn_error(c, H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = get_u32(payload) & 0x7fffffff;
+
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        }
+        c->send_window += increment;
+        if (c->send_window > H2_MAX_WINDOW) {
+            return conn_error(c, H2_FLOW_CONTROL_ERROR);
+        }
+        return 0;
+    }
+
+    h2_stream_t *s = stream_find(c, stream_id);
+    if (s == NULL || s->done) {
+        return 0;   // closed streams may still see updates in flight
+    }
+    if (increment == 0) {
+        return stream_reset(c, s, stream_id, H2_PROTOCOL_ERROR);
+    }
+    s->window += increment;
+    if (s->window > H2_MAX_WINDOW) {
+        return stream_reset(c, s, stream_id, H2_FLOW_CONTROL_ERROR);
+    }
+    return 0;
+}
+
+static int handle_frame(h2_conn_t *c, uint8_t type, uint8_t flags, uint32_t stream_id,
+                        const uint8_t *payload, size_t len) {
+    // Nothing may interleave with a header block
+    if (c->header_stream != 0 && type != H2_CONTINUATION) {
+        return conn_error(c, H2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case H2_DATA:          return handle_data(c, flags, stream_id, payload, len);
+    case H2_HEADERS:       return handle_headers(c, flags, stream_id, payload, len);
+    case H2_CONTINUATION:  return handle_continuation(c, flags, stream_id, payload, len);
+    case H2_PRIORITY:      return handle_priority(c, stream_id, payload, len);
+    case H2_RST_STREAM:    return handle_rst_stream(c, stream_id, len);
+    case H2_SETTINGS:      return handle_settings(c, flags, stream_id, payload, len);
+    case H2_PING:          return handle_ping(c, flags, stream_id, payload, len);
+    case H2_WINDOW_UPDATE: return handle_window_update(c, stream_id, payload, len);
+    case H2_PUSH_PROMISE:  return conn_error(c, H2_PROTOCOL_ERROR);
+    case H2_GOAWAY:
+        if (stream_id != 0) {
+            return conn_error(c, H2_PROTOCOL_ERROR);
+        }
+        c->goaway = true;
+        return 0;
+    default:               // unknown frame types are ignored
+        return 0;
+    }
+}
+
+// ================================
+// Response scheduling
+// ================================
+
+static int send_response_headers(h2_conn_t *c, h2_stream_t *s) {
+    uint8_t block[512];
+    char status[8], length[24];
+    size_t n = 0;
+
+    snprintf(status, sizeof(status), "%d", s->status);
+    snprintf(length, sizeof(length), "%zu", s->body_len);
+    n += hpack_encode_header(block + n, sizeof(block) - n, ":status", status);
+    n += hpack_encode_header(block + n, sizeof(block) - n, "content-type", s->content_type);
+    if (s->location[0] != '\0') {
+        n += hpack_encode_header(block + n, sizeof(block) - n, "location", s->location);
+    }
+    if (s->retry_after[0] != '\0') {
+        n += hpack_encode_header(block + n, sizeof(block) - n, "retry-after", s->retry_after);
+    }
+    if (s->stream == NULL) {
+        n += hpack_encode_header(block + n, sizeof(block) - n, "content-length", length);
+    }
+
+    uint8_t flags = H2_FLAG_END_HEADERS;
+    if (s->stream == NULL && s->body_len == 0) {
+        flags |= H2_FLAG_END_STREAM;
+        s->done = true;
+    }
+    s->headers_sent = true;
+    if (s->vtime < c->vclock) {
+        s->vtime = c->vclock;
+    }
+    return frame_write(c, H2_HEADERS, flags, s->id, block, n);
+}
+
+static bool stream_sendable(const h2_stream_t *s) {
+    bool more = s->stream != NULL || s->sent < s->body_len;
+    return s->id != 0 && s->headers_sent && !s->done && more && s->window > 0;
+}
+
+// Pulls the next piece of a streamed body; returns its length, 0 at the end
+static ssize_t stream_refill(h2_stream_t *s) {
+    if (s->chunk == NULL) {
+        s->chunk = malloc(H2_MAX_FRAME);
+        if (s->chunk == NULL) {
+            return -1;
+        }
+    }
+    ssize_t n = handler_stream_read(s->stream, s->chunk, H2_MAX_FRAME);
+    s->chunk_len = n > 0 ? (size_t)n : 0;
+    s->chunk_pos = 0;
+    return n;
+}
+
+// Weighted fair choice: lowest virtual finish time wins; a stream waits
+// while the stream it depends on still has data to send.
+static h2_stream_t *pick_stream(h2_conn_t *c) {
+    for (int pass = 0; pass < 2; pass++) {
+        h2_stream_t *best = NULL;
+        for (int i = 0; i < H2_MAX_STREAMS; i++) {
+            h2_stream_t *s = &c->streams[i];
+            if (!stream_sendable(s)) {
+                continue;
+            }
+            if (pass == 0 && s->depends_on != 0) {
+                h2_stream_t *parent = stream_find(c, s->depends_on);
+                if (parent != NULL && stream_sendable(parent)) {
+                    continue;
+                }
+            }
+            if (best == NULL || s->vtime < best->vtime) {
+                best = s;
+            }
+        }
+        if (best != NULL) {
+            return best;
+        }
+    }
+    return NULL;
+}
+
+static int send_responses(h2_conn_t *c) {
+    bool ready[H2_MAX_STREAMS];
+
+    pthread_mutex_lock(&c->mutex);
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        ready[i] = c->streams[i].id != 0 && c->streams[i].response_ready;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        h2_stream_t *s = &c->streams[i];
+        if (!ready[i] || s->headers_sent || s->done) {
+            continue;
+        }
+        if (s->entry == NULL && s->stream == NULL) {
+            if (stream_reset(c, s, s->id, H2_INTERNAL_ERROR) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (send_response_headers(c, s) != 0) {
+            return -1;
+        }
+    }
+
+    while (c->send_window > 0) {
+        h2_stream_t *s = pick_stream(c);
+        if (s == NULL) {
+            break;
+        }
+        const char *data;
+        size_t n;
+        uint8_t flags = 0;
+        if (s->stream != NULL) {
+            if (s->chunk_pos == s->chunk_len) {
+                ssize_t got = stream_refill(s);
+                if (got < 0) {
+                    if (stream_reset(c, s, s->id, H2_INTERNAL_ERROR) != 0) {
+                        return -1;
+                    }
+                    continue;
+                }
+                if (got == 0) {
+                    if (frame_write(c, H2_DATA, H2_FLAG_END_STREAM, s->id, NULL, 0) != 0) {
+                        return -1;
+                    }
+                    s->done = true;
+                    continue;
+                }
+            }
+            data = s->chunk + s->chunk_pos;
+            n = s->chunk_len - s->chunk_pos;
+        } else {
+            data = s->body + s->sent;
+            n = s->body_len - s->sent;
+        }
+        if (n > (size_t)s->window) n = s->window;
+        if (n > (size_t)c->send_window) n = c->send_window;
+        if (n > c->peer_max_frame) n = c->peer_max_frame;
+
+        if (s->stream == NULL && s->sent + n == s->body_len) {
+            flags = H2_FLAG_END_STREAM;
+        }
+        // Over its bandwidth the client's frames are delayed, not dropped:
+        // this one is held in the write buffer until the wait is over
+        uint64_t wait = handler_pace(c->client_ip, s->path, n);
+        if (wait > 0) {
+            if (conn_flush(c) != 0) {
+                return -1;
+            }
+            c->send_after_ns = now_ns() + wait;
+        }
+        if (frame_write(c, H2_DATA, flags, s->id, data, n) != 0) {
+            return -1;
+        }
+        if (s->stream != NULL) {
+            s->chunk_pos += n;
+        }
+        s->sent += n;
+        s->window -= n;
+        c->send_window -= n;
+        s->vtime += (uint64_t)n * 256 / s->weight;
+        c->vclock = s->vtime;
+        if (flags & H2_FLAG_END_STREAM) {
+            s->done = true;
+        }
+        if (wait > 0) {
+            break;
+        }
+        if (c->out_len >= H2_OUT_FLUSH && conn_flush(c) != 0) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id != 0 && c->streams[i].done) {
+            stream_retire(c, &c->streams[i]);
+        }
+    }
+    return 0;
+}
+
+// ================================
+// Connection lifecycle
+// ================================
+
+static int conn_init(h2_conn_t *c, int fd) {
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->client_ip = handler_client_ip(fd);
+    c->send_window = H2_DEFAULT_WINDOW;
+    c->peer_initial_window = H2_DEFAULT_WINDOW;
+    c->peer_max_frame = 16384;
+    c->idle_since_ns = now_ns();
+    c->in_cap = H2_FRAME_HEADER_LEN + H2_MAX_FRAME + 4096;
+    c->in = malloc(c->in_cap);
+    c->header_block = malloc(H2_MAX_HEADER_BLOCK);
+
+    if (c->in == NULL || c->header_block == NULL) {
+        perror("[HTTP2] Failed to allocate connection buffers");
+        goto fail;
+    }
+    if (hpack_table_init(&c->decoder, HPACK_DEFAULT_TABLE_SIZE) != 0) {
+        goto fail;
+    }
+    if (pipe(c->wake_pipe) != 0) {
+        perror("[HTTP2] Failed to create wake pipe");
+        hpack_table_free(&c->decoder);
+        goto fail;
+    }
+    fcntl(c->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(c->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->jobs_done, NULL);
+    return 0;
+
+fail:
+    free(c->in);
+    free(c->header_block);
+    return -1;
+}
+
+static void conn_free(h2_conn_t *c) {
+    // Workers may still be resolving streams that point into c
+    pthread_mutex_lock(&c->mutex);
+    while (c->jobs_pending > 0) {
+        pthread_cond_wait(&c->jobs_done, &c->mutex);
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (c->streams[i].id != 0) {
+            cache_release(c->streams[i].entry);
+            handler_stream_close(c->streams[i].stream);
+            free(c->streams[i].chunk);
+        }
+    }
+    hpack_table_free(&c->decoder);
+    close(c->wake_pipe[0]);
+    close(c->wake_pipe[1]);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->jobs_done);
+    free(c->in);
+    free(c->out);
+    free(c->header_block);
+}
+
+static int send_server_settings(h2_conn_t *c) {
+    uint8_t payload[6];
+    payload[0] = 0;
+    payload[1] = 0x3;   // MAX_CONCURRENT_STREAMS
+    put_u32(payload + 2, H2_MAX_STREAMS);
+    return frame_write(c, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+// Consumes complete frames from the input buffer
+static int process_input(h2_conn_t *c, bool *need_preface) {
+    size_t offset = 0;
+
+    if (*need_preface) {
+        size_t n = c->in_len < H2_PREFACE_LEN ? c->in_len : H2_PREFACE_LEN;
+        if (memcmp(c->in, H2_PREFACE, n) != 0) {
+            return -1;
+        }
+        if (c->in_len < H2_PREFACE_LEN) {
+            return 0;
+        }
+        offset = H2_PREFACE_LEN;
+        *need_preface = false;
+    }
+
+    int rc = 0;
+    while (c->in_len - offset >= H2_FRAME_HEADER_LEN) {
+        const uint8_t *h = c->in + offset;
+        size_t len = get_u24(h);
+        if (len > H2_MAX_FRAME) {
+            rc = conn_error(c, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (c->in_len - offset < H2_FRAME_HEADER_LEN + len) {
+            break;
+        }
+        rc = handle_frame(c, h[3], h[4], get_u32(h + 5) & 0x7fffffff,
+                          h + H2_FRAME_HEADER_LEN, len);
+        if (rc != 0) {
+            break;
+        }
+        offset += H2_FRAME_HEADER_LEN + len;
+    }
+
+    memmove(c->in, c->in + offset, c->in_len - offset);
+    c->in_len -= offset;
+    return rc;
+}
+
+// True while a finished stream job's response has not been picked up
+static bool responses_waiting(h2_conn_t *c) {
+    bool waiting = c->jobs_pending > 0;
+    for (int i = 0; i < H2_MAX_STREAMS && !waiting; i++) {
+        h2_stream_t *s = &c->streams[i];
+        waiting = s->id != 0 && s->response_ready && !s->headers_sent && !s->done;
+    }
+    return waiting;
+}
+
+// Serves the connection until it has nothing to do but wait for the client.
+// Returns 0 to park it, -1 once it is finished.
+static int conn_serve(h2_conn_t *c) {
+    while (1) {
+        char drain[64];
+        while (read(c->wake_pipe[0], drain, sizeof(drain)) > 0) {
+        }
+        if (process_input(c, &c->need_preface) != 0) {
+            return -1;
+        }
+        if (now_ns() >= c->send_after_ns) {
+            if (send_responses(c) != 0) {
+                return -1;
+            }
+            if (now_ns() >= c->send_after_ns && conn_flush(c) != 0) {
+                return -1;
+            }
+        }
+        if (c->goaway && c->active_streams == 0) {
+            return -1;
+        }
+
+        if (c->in_len < c->in_cap) {
+            ssize_t bytes = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+            if (bytes == 0) {
+                return -1;
+            }
+            if (bytes > 0) {
+                c->in_len += bytes;
+                c->idle_since_ns = now_ns();
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return -1;
+            }
+        }
+
+        // A short pacing wait may be over already: send what it held back
+        if (c->out_len > 0 && now_ns() >= c->send_after_ns) {
+            continue;
+        }
+        pthread_mutex_lock(&c->mutex);
+        bool waiting = responses_waiting(c);
+        pthread_mutex_unlock(&c->mutex);
+        if (!waiting) {
+            return 0;
+        }
+
+        // Stream jobs are short: wait for them here rather than park
+        struct pollfd fds[2];
+        fds[0].fd = c->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = c->wake_pipe[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, H2_POLL_MS) < 0 && errno != EINTR) {
+            perror("[HTTP2] poll failed");
+            return -1;
+        }
+    }
+}
+
+static void conn_close(h2_conn_t *c) {
+    conn_free(c);
+    close(c->fd);
+    trace_commit();
+    free(c);
+}
+
+// task_fn: runs the connection, then parks it until the client sends more,
+// held-back output may go out, or the idle timeout has passed
+static void conn_run(void *arg) {
+    h2_conn_t *c = arg;
+    trace_attach(&c->span);
+
+    if (conn_serve(c) == 0) {
+        uint64_t now = now_ns();
+        uint64_t idle_deadline = c->idle_since_ns + (uint64_t)H2_IDLE_TIMEOUT_MS * 1000000;
+
+        // Open streams do not hold the connection: a client that never opens
+        // its window is as idle as one that sends nothing
+        if (now >= idle_deadline) {
+            conn_error(c, H2_NO_ERROR);
+            conn_close(c);
+            return;
+        }
+        uint64_t delay = idle_deadline - now;
+        if (now < c->send_after_ns && c->send_after_ns - now < delay) {
+            delay = c->send_after_ns - now;
+        }
+        trace_attach(NULL);
+        if (threadpool_defer(conn_run, c, c->fd, delay) == 0) {
+            return;     // c belongs to whichever worker resumes it
+        }
+        trace_attach(&c->span);
+    }
+    conn_close(c);
+}
+
+bool http2_is_preface(const char *buf, size_t len) {
+    // "PRI * HTTP/2.0" is enough to tell it from any HTTP/1 request line
+    return len >= 14 && memcmp(buf, H2_PREFACE, 14) == 0;
+}
+
+bool http2_is_upgrade(const char *request) {
+    char upgrade[64], settings[8];
+    if (!handler_find_header(request, "Upgrade", upgrade, sizeof(upgrade)) ||
+        !handler_find_header(request, "HTTP2-Settings", settings, sizeof(settings))) {
+        return false;
+    }
+    return strncasecmp(upgrade, "h2c", 3) == 0;
+}
+
+static int base64url_decode(const char *in, uint8_t *out, size_t out_size) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+
+    for (const char *p = in; *p && *p != '='; p++) {
+        int v;
+        if (*p >= 'A' && *p <= 'Z') v = *p - 'A';
+        else if (*p >= 'a' && *p <= 'z') v = *p - 'a' + 26;
+        else if (*p >= '0' && *p <= '9') v = *p - '0' + 52;
+        else if (*p == '-' || *p == '+') v = 62;
+        else if (*p == '_' || *p == '/') v = 63;
+        else return -1;
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= out_size) return -1;
+            out[n++] = (acc >> bits) & 0xff;
+        }
+    }
+    return (int)n;
+}
+
+void http2_serve_connection(int fd, const char *initial, size_t initial_len) {
+    h2_conn_t *c = malloc(sizeof(h2_conn_t));
+    if (c == NULL || conn_init(c, fd) != 0) {
+        free(c);
+        close(fd);
+        return;
+    }
+    if (initial_len > c->in_cap) {
+        initial_len = c->in_cap;
+    }
+    memcpy(c->in, initial, initial_len);
+    c->in_len = initial_len;
+
+    if (send_server_settings(c) != 0) {
+        conn_close(c);
+        return;
+    }
+    trace_detach(&c->span);
+    c->need_preface = true;
+    conn_run(c);
+}
+
+void http2_serve_upgrade(int fd, const char *request, size_t request_len,
+                         const char *method, const char *path) {
+    char encoded[512];
+    uint8_t settings[384];
+    int settings_len = -1;
+
+    if (handler_find_header(request, "HTTP2-Settings", encoded, sizeof(encoded))) {
+        settings_len = base64url_decode(encoded, settings, sizeof(settings));
+    }
+    if (settings_len < 0 || settings_len % 6 != 0) {
+        const char *msg = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, (const uint8_t *)msg, strlen(msg));
+        close(fd);
+        return;
+    }
+
+    const char *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                            "Connection: Upgrade\r\n"
+                            "Upgrade: h2c\r\n\r\n";
+    if (send_all(fd, (const uint8_t *)switching, strlen(switching)) != 0) {
+        close(fd);
+        return;
+    }
+
+    h2_conn_t *c = malloc(sizeof(h2_conn_t));
+    if (c == NULL || conn_init(c, fd) != 0) {
+        free(c);
+        close(fd);
+        return;
+    }
+
+    // Anything after the request head is already HTTP/2 (the client preface)
+    const char *head_end = strstr(request, "\r\n\r\n");
+    if (head_end != NULL) {
+        size_t consumed = head_end + 4 - request;
+        size_t rest = request_len > consumed ? request_len - consumed : 0;
+        if (rest > c->in_cap) rest = c->in_cap;
+        memcpy(c->in, head_end + 4, rest);
+        c->in_len = rest;
+    }
+
+    if (apply_settings(c, settings, settings_len) == 0 && send_server_settings(c) == 0) {
+        // The upgrade request itself becomes stream 1, already half-closed
+        h2_stream_t *s = stream_alloc(c, 1);
+        snprintf(s->method, sizeof(s->method), "%s", method);
+        snprintf(s->path, sizeof(s->path), "%s", path);
+        s->end_stream = true;
+        c->last_stream_id = 1;
+        stream_dispatch(c, s);
+        trace_detach(&c->span);
+        c->need_preface = true;
+        conn_run(c);
+        return;
+    }
+    conn_close(c);
+}
@@ -1,5 +1,9 @@
 #include "server.h"
 #include "threadpool.h"
+#include "cache.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "upload.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -7,10 +11,23 @@
 
 static int g_server_fd = -1;
 
+// Per-IP limits apply to every request; path rules stack on top of them
+static const ratelimit_rule_t per_ip_limit = {
+    "", RATELIMIT_DEFAULT_RPS, RATELIMIT_DEFAULT_BURST,
+    RATELIMIT_DEFAULT_BPS, RATELIMIT_DEFAULT_BYTE_BURST
+};
+static const ratelimit_rule_t path_limits[] = {
+    { "/__stats", 5, 10, 0, 0 },
+    { "/__trace", 5, 10, 0, 0 },
+};
+
 void signal_handler(int sig) {
     printf("\nReceived signal %d, shutting down...\n", sig);
     
     threadpool_shutdown();
+    cache_destroy();
+    ratelimit_destroy();
+    trace_destroy();
     
     if (g_server_fd >= 0) {
         close(g_server_fd);
@@ -25,6 +42,38 @@ int main(void) {
     
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);   // a client hanging up must not kill the server
+    
+    if (cache_init(CACHE_DEFAULT_CAPACITY, CACHE_DEFAULT_TTL, CACHE_DEFAULT_STALE) != 0) {
+        fprintf(stderr, "Failed to initialize response cache\n");
+        return EXIT_FAILURE;
+    }
+    
+    // Loopback is exempt so local tooling and benchmarks are not throttled
+    if (ratelimit_init(&per_ip_limit, true) != 0) {
+        fprintf(stderr, "Failed to initialize rate limiter\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < sizeof(path_limits) / sizeof(path_limits[0]); i++) {
+        ratelimit_add_rule(&path_limits[i]);
+    }
+    
+    // UPLOAD_MAX_BYTES lowers the per-upload limit (the upload test uses it)
+    uint64_t upload_max = UPLOAD_DEFAULT_MAX;
+    const char *upload_max_env = getenv("UPLOAD_MAX_BYTES");
+    if (upload_max_env != NULL && *upload_max_env != '\0') {
+        upload_max = strtoull(upload_max_env, NULL, 10);
+    }
+    if (upload_init(UPLOAD_DEFAULT_DIR, upload_max) != 0) {
+        fprintf(stderr, "Failed to initialize uploads\n");
+        return EXIT_FAILURE;
+    }
+    
+    // Before any thread starts: the dump signal must stay blocked in all of them
+    if (trace_init(TRACE_DEFAULT_SAMPLE_EVERY) != 0) {
+        fprintf(stderr, "Failed to initialize tracing\n");
+        return EXIT_FAILURE;
+    }
     
     printf("Initializing thread pool with %d workers...\n", num_threads);
     if (threadpool_init(num_threads) != 0) {
@@ -36,6 +85,9 @@ int main(void) {
     g_server_fd = server_file_descriptor;  
     main_accept_loop(server_file_descriptor);
     threadpool_shutdown();
+    cache_destroy();
+    ratelimit_destroy();
+    trace_destroy();
     close(server_file_descriptor);
     
     return 0;
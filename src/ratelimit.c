@@ -0,0 +1,322 @@
+// ratelimit.c - Sharded token buckets
+//
+// Each (IP, rule) pair owns one request bucket and one byte bucket. Buckets
+// are refilled lazily from the time elapsed since they were last touched,
+// so idle clients cost nothing. Every shard has its own mutex and the
+// critical sections are a handful of arithmetic operations.
+//
+// Byte buckets may go negative: a sender takes what it needs and then waits
+// off the debt. Concurrent transfers from one client therefore share its
+// bandwidth instead of being refused.
+
+#include "ratelimit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct bucket_entry {
+    uint32_t ip;
+    int rule;
+    double request_tokens;
+    double byte_tokens;
+    uint64_t refilled_ns;
+    struct bucket_entry *next;
+} bucket_entry_t;
+
+typedef struct shard {
+    pthread_mutex_t mutex;
+    bucket_entry_t *buckets[RATELIMIT_BUCKETS];
+    uint64_t swept_ns;
+    unsigned long entries;
+    unsigned long evicted;
+} shard_t;
+
+static shard_t shards[RATELIMIT_SHARDS];
+static ratelimit_rule_t rules[RATELIMIT_MAX_RULES];
+static char rule_prefixes[RATELIMIT_MAX_RULES][128];
+static int rule_count = 0;
+static bool exempt_loopback_ips = false;
+static bool limiter_initialized = false;
+
+// Bumped on every request: relaxed atomics keep them off any lock
+static atomic_ulong admitted_count;
+static atomic_ulong rejected_count;
+static atomic_ulong paced_count;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static double min_double(double a, double b) {
+    return a < b ? a : b;
+}
+
+static uint32_t hash_key(uint32_t ip, int rule) {
+    uint32_t h = ip * 2654435761u;
+    h ^= (uint32_t)rule * 40503u;
+    h ^= h >> 15;
+    return h;
+}
+
+static void refill(bucket_entry_t *e, const ratelimit_rule_t *r, uint64_t now) {
+    double elapsed = (now - e->refilled_ns) / 1e9;
+    e->request_tokens = min_double(r->request_burst, e->request_tokens + elapsed * r->requests_per_sec);
+    e->byte_tokens = min_double(r->byte_burst, e->byte_tokens + elapsed * r->bytes_per_sec);
+    e->refilled_ns = now;
+}
+
+// Drops entries that have been idle long enough to be full again anyway
+static void sweep(shard_t *s, uint64_t now) {
+    uint64_t idle = (uint64_t)RATELIMIT_IDLE_SECONDS * 1000000000ull;
+    for (int b = 0; b < RATELIMIT_BUCKETS; b++) {
+        bucket_entry_t **pp = &s->buckets[b];
+        while (*pp != NULL) {
+            bucket_entry_t *e = *pp;
+            bool stale = now - e->refilled_ns > idle;
+            if (stale) {
+                // Tokens are only refilled on use: settle the byte debt first
+                refill(e, &rules[e->rule], now);
+            }
+            if (stale && e->byte_tokens >= 0) {
+                *pp = e->next;
+                free(e);
+                s->entries--;
+                s->evicted++;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+    s->swept_ns = now;
+}
+
+// Returns the refilled entry with the shard locked, or NULL (shard unlocked)
+static bucket_entry_t *acquire(uint32_t ip, int rule, shard_t **out_shard) {
+    uint32_t h = hash_key(ip, rule);
+    shard_t *s = &shards[h % RATELIMIT_SHARDS];
+    bucket_entry_t **chain = &s->buckets[(h / RATELIMIT_SHARDS) % RATELIMIT_BUCKETS];
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&s->mutex);
+    if (now - s->swept_ns > (uint64_t)RATELIMIT_SWEEP_SECONDS * 1000000000ull) {
+        sweep(s, now);
+    }
+
+    bucket_entry_t *e = *chain;
+    while (e != NULL && (e->ip != ip || e->rule != rule)) {
+        e = e->next;
+    }
+    if (e == NULL) {
+        e = malloc(sizeof(bucket_entry_t));
+        if (e == NULL) {
+            pthread_mutex_unlock(&s->mutex);
+            return NULL;
+        }
+        e->ip = ip;
+        e->rule = rule;
+        e->request_tokens = rules[rule].request_burst;
+        e->byte_tokens = rules[rule].byte_burst;
+        e->refilled_ns = now;
+        e->next = *chain;
+        *chain = e;
+        s->entries++;
+    } else {
+        refill(e, &rules[rule], now);
+    }
+    *out_shard = s;
+    return e;
+}
+
+static bool rule_matches(int rule, const char *path) {
+    return strncmp(path, rules[rule].prefix, strlen(rules[rule].prefix)) == 0;
+}
+
+static bool is_exempt(uint32_t ip) {
+    return !limiter_initialized || (exempt_loopback_ips && (ip >> 24) == 127);
+}
+
+static void count(atomic_ulong *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static int store_rule(const ratelimit_rule_t *rule) {
+    if (rule_count >= RATELIMIT_MAX_RULES) {
+        fprintf(stderr, "[RateLimit] Too many rules\n");
+        return -1;
+    }
+    int i = rule_count++;
+    snprintf(rule_prefixes[i], sizeof(rule_prefixes[i]), "%s", rule->prefix ? rule->prefix : "");
+    rules[i] = *rule;
+    rules[i].prefix = rule_prefixes[i];
+    return 0;
+}
+
+int ratelimit_init(const ratelimit_rule_t *per_ip, bool exempt_loopback) {
+    if (limiter_initialized) {
+        fprintf(stderr, "[RateLimit] Already initialized\n");
+        return -1;
+    }
+    for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+        memset(&shards[i], 0, sizeof(shard_t));
+        if (pthread_mutex_init(&shards[i].mutex, NULL) != 0) {
+            perror("[RateLimit] Failed to initialize shard mutex");
+            return -1;
+        }
+        shards[i].swept_ns = now_ns();
+    }
+    atomic_store(&admitted_count, 0);
+    atomic_store(&rejected_count, 0);
+    atomic_store(&paced_count, 0);
+    rule_count = 0;
+    exempt_loopback_ips = exempt_loopback;
+
+    ratelimit_rule_t global = *per_ip;
+    global.prefix = "";
+    if (store_rule(&global) != 0) {
+        return -1;
+    }
+    limiter_initialized = true;
+    printf("[RateLimit] Per-IP limit %.0f req/s (burst %.0f), %.0f bytes/s (burst %.0f)\n",
+           per_ip->requests_per_sec, per_ip->request_burst,
+           per_ip->bytes_per_sec, per_ip->byte_burst);
+    return 0;
+}
+
+int ratelimit_add_rule(const ratelimit_rule_t *rule) {
+    if (store_rule(rule) != 0) {
+        return -1;
+    }
+    printf("[RateLimit] Rule '%s': %.0f req/s (burst %.0f), %.0f bytes/s (burst %.0f)\n",
+           rule->prefix, rule->requests_per_sec, rule->request_burst,
+           rule->bytes_per_sec, rule->byte_burst);
+    return 0;
+}
+
+void ratelimit_destroy(void) {
+    if (!limiter_initialized) {
+        return;
+    }
+    limiter_initialized = false;
+    for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+        for (int b = 0; b < RATELIMIT_BUCKETS; b++) {
+            bucket_entry_t *e = shards[i].buckets[b];
+            while (e != NULL) {
+                bucket_entry_t *next = e->next;
+                free(e);
+                e = next;
+            }
+            shards[i].buckets[b] = NULL;
+        }
+        pthread_mutex_unlock(&shards[i].mutex);
+        pthread_mutex_destroy(&shards[i].mutex);
+    }
+}
+
+int ratelimit_admit(uint32_t ip, const char *path) {
+    if (is_exempt(ip)) {
+        return 0;
+    }
+
+    int taken[RATELIMIT_MAX_RULES];
+    int taken_count = 0;
+    double wait = 0;
+
+    for (int r = 0; r < rule_count; r++) {
+        if (rules[r].requests_per_sec <= 0 || !rule_matches(r, path)) {
+            continue;
+        }
+        shard_t *s;
+        bucket_entry_t *e = acquire(ip, r, &s);
+        if (e == NULL) {
+            continue;   // out of memory: fail open rather than refuse service
+        }
+        if (e->request_tokens >= 1) {
+            e->request_tokens -= 1;
+            taken[taken_count++] = r;
+        } else {
+            double need = (1 - e->request_tokens) / rules[r].requests_per_sec;
+            if (need > wait) wait = need;
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+
+    if (wait <= 0) {
+        count(&admitted_count);
+        return 0;
+    }
+
+    // Refused by one bucket: give back what the others handed out
+    for (int i = 0; i < taken_count; i++) {
+        shard_t *s;
+        bucket_entry_t *e = acquire(ip, taken[i], &s);
+        if (e != NULL) {
+            e->request_tokens = min_double(rules[taken[i]].request_burst, e->request_tokens + 1);
+            pthread_mutex_unlock(&s->mutex);
+        }
+    }
+    count(&rejected_count);
+    int seconds = (int)wait;
+    return seconds < wait ? seconds + 1 : seconds;
+}
+
+uint64_t ratelimit_pace(uint32_t ip, const char *path, size_t bytes) {
+    if (bytes == 0 || is_exempt(ip)) {
+        return 0;
+    }
+
+    double wait = 0;
+    for (int r = 0; r < rule_count; r++) {
+        if (rules[r].bytes_per_sec <= 0 || !rule_matches(r, path)) {
+            continue;
+        }
+        shard_t *s;
+        bucket_entry_t *e = acquire(ip, r, &s);
+        if (e == NULL) {
+            continue;
+        }
+        e->byte_tokens -= bytes;
+        if (e->byte_tokens < 0) {
+            double need = -e->byte_tokens / rules[r].bytes_per_sec;
+            if (need > wait) wait = need;
+        }
+        pthread_mutex_unlock(&s->mutex);
+    }
+    if (wait > 0) {
+        count(&paced_count);
+    }
+    return (uint64_t)(wait * 1e9);
+}
+
+void ratelimit_sleep(uint64_t ns) {
+    if (ns == 0) {
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+
+void ratelimit_get_stats(ratelimit_stats_t *out) {
+    out->admitted = atomic_load_explicit(&admitted_count, memory_order_relaxed);
+    out->rejected = atomic_load_explicit(&rejected_count, memory_order_relaxed);
+    out->paced = atomic_load_explicit(&paced_count, memory_order_relaxed);
+    out->entries = 0;
+    out->evicted = 0;
+    if (!limiter_initialized) {
+        return;
+    }
+    for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+        out->entries += shards[i].entries;
+        out->evicted += shards[i].evicted;
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+}
@@ -11,6 +11,7 @@
 #include <errno.h>
 #include "handler.h"
 #include "threadpool.h"
+#include "trace.h"
 
 #define SERVER_BACKLOG 10
 #define BUFFER_SIZE 1024
@@ -86,7 +87,9 @@ int main_accept_loop(int server_file_descriptor) {
             continue;  
         }
 
-        if (enqueue_client(client_file_descriptor) != 0) {
+        trace_span_t span;
+        trace_begin(&span);
+        if (enqueue_client(client_file_descriptor, &span) != 0) {
             fprintf(stderr, "Failed to enqueue client, closing connection\n");
             close(client_file_descriptor);
         }
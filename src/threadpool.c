@@ -8,6 +8,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 static threadpool_t pool;
 static bool pool_initialized = false;
@@ -17,6 +20,10 @@ static int queue_init(request_queue_t *q, int max_size) {
     q->tail = NULL;
     q->size = 0;
     q->max_size = max_size;
+    q->task_head = NULL;
+    q->task_tail = NULL;
+    q->task_count = 0;
+    q->idle_workers = 0;
     
     if (pthread_mutex_init(&q->mutex, NULL) != 0) {
         perror("[ThreadPool] Failed to initialize mutex");
@@ -48,19 +55,31 @@ static void queue_destroy(request_queue_t *q) {
     q->head = NULL;
     q->tail = NULL;
     q->size = 0;
+    current = q->task_head;
+    while (current != NULL) {
+        queue_node_t *next = current->next;
+        free(current);
+        current = next;
+    }
+    q->task_head = NULL;
+    q->task_tail = NULL;
+    q->task_count = 0;
     pthread_mutex_unlock(&q->mutex);
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->not_empty);
     pthread_cond_destroy(&q->not_full);
 }
 
-static int queue_push(request_queue_t *q, int client_fd) {
+static int queue_push(request_queue_t *q, int client_fd, const trace_span_t *span) {
     queue_node_t *node = malloc(sizeof(queue_node_t));
     if (node == NULL) {
         perror("[ThreadPool] Failed to allocate queue node");
         return -1;
     }
     node->client_fd = client_fd;
+    node->task = NULL;
+    node->arg = NULL;
+    node->span = *span;
     node->next = NULL;
     pthread_mutex_lock(&q->mutex);
     while (q->size >= q->max_size && !pool.shutdown) {
@@ -80,32 +99,224 @@ static int queue_push(request_queue_t *q, int client_fd) {
         q->tail->next = node;
         q->tail = node;
     }
+    trace_stamp(&node->span, TRACE_ENQUEUED);
     q->size++;
     pthread_cond_signal(&q->not_empty);
     pthread_mutex_unlock(&q->mutex);
     return 0;
 }
 
-static int queue_pop(request_queue_t *q) {
+// only_if_idle: refuse unless an idle worker will pick this up before any
+// client; deferred tasks are always queued since they never wait on a worker
+static int queue_push_task(request_queue_t *q, task_fn fn, void *arg, bool only_if_idle) {
+    queue_node_t *node = malloc(sizeof(queue_node_t));
+    if (node == NULL) {
+        perror("[ThreadPool] Failed to allocate task node");
+        return -1;
+    }
+    node->client_fd = -1;
+    node->task = fn;
+    node->arg = arg;
+    node->next = NULL;
     pthread_mutex_lock(&q->mutex);
-    while (q->size == 0 && !pool.shutdown) {
+    if (pool.shutdown || (only_if_idle && q->idle_workers <= q->task_count)) {
+        pthread_mutex_unlock(&q->mutex);
+        free(node);
+        return -1;
+    }
+    if (q->task_tail == NULL) {
+        q->task_head = node;
+        q->task_tail = node;
+    } else {
+        q->task_tail->next = node;
+        q->task_tail = node;
+    }
+    q->task_count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+// Returns the next task or client node (caller frees), or NULL on shutdown.
+static queue_node_t *queue_pop(request_queue_t *q) {
+    pthread_mutex_lock(&q->mutex);
+    q->idle_workers++;
+    while (q->size == 0 && q->task_count == 0 && !pool.shutdown) {
         pthread_cond_wait(&q->not_empty, &q->mutex);
     }
+    q->idle_workers--;
+    if (q->task_count > 0) {
+        queue_node_t *node = q->task_head;
+        q->task_head = node->next;
+        if (q->task_head == NULL) {
+            q->task_tail = NULL;
+        }
+        q->task_count--;
+        pthread_mutex_unlock(&q->mutex);
+        return node;
+    }
     if (pool.shutdown && q->size == 0) {
         pthread_mutex_unlock(&q->mutex);
-        return -1;
+        return NULL;
     }
     queue_node_t *node = q->head;
-    int client_fd = node->client_fd;
     q->head = node->next;
     if (q->head == NULL) {
         q->tail = NULL;
     }
     q->size--;
-    free(node);
     pthread_cond_signal(&q->not_full);
     pthread_mutex_unlock(&q->mutex);
-    return client_fd;
+    return node;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Builds the poll set from the deferred list; returns its size and the
+// poll timeout until the earliest deadline. Called with deferred_mutex held.
+static int deferred_poll_set(struct pollfd *fds, int *timeout_ms) {
+    uint64_t now = now_ns();
+    int n = 1;
+
+    fds[0].fd = pool.wake_pipe[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    *timeout_ms = -1;
+    for (deferred_task_t *d = pool.deferred; d != NULL; d = d->next) {
+        d->poll_index = -1;
+        if (d->fd >= 0) {
+            d->poll_index = n;
+            fds[n].fd = d->fd;
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            n++;
+        }
+        if (d->due_ns != 0) {
+            uint64_t wait_ms = d->due_ns <= now ? 0 : (d->due_ns - now + 999999) / 1000000;
+            if (*timeout_ms < 0 || wait_ms < (uint64_t)*timeout_ms) {
+                *timeout_ms = (int)wait_ms;
+            }
+        }
+    }
+    return n;
+}
+
+// Waits on every deferred socket and deadline at once, so parked
+// connections cost a list entry instead of a worker
+static void *waiter_routine(void *arg) {
+    (void)arg;
+    struct pollfd *fds = NULL;
+    int fds_cap = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pool.deferred_mutex);
+        if (!pool.waiter_running) {
+            pthread_mutex_unlock(&pool.deferred_mutex);
+            break;
+        }
+        if (pool.deferred_count + 1 > fds_cap) {
+            int new_cap = (pool.deferred_count + 1) * 2;
+            struct pollfd *grown = realloc(fds, sizeof(struct pollfd) * new_cap);
+            if (grown == NULL) {
+                pthread_mutex_unlock(&pool.deferred_mutex);
+                perror("[ThreadPool] Failed to grow poll set");
+                usleep(10000);
+                continue;
+            }
+            fds = grown;
+            fds_cap = new_cap;
+        }
+        int timeout_ms;
+        int n = deferred_poll_set(fds, &timeout_ms);
+        pthread_mutex_unlock(&pool.deferred_mutex);
+
+        if (poll(fds, n, timeout_ms) < 0 && errno != EINTR) {
+            perror("[ThreadPool] poll failed");
+            usleep(10000);
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(pool.wake_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+
+        // Entries added meanwhile have no poll slot and only count if due
+        deferred_task_t *ready = NULL;
+        pthread_mutex_lock(&pool.deferred_mutex);
+        uint64_t now = now_ns();
+        deferred_task_t **link = &pool.deferred;
+        while (*link != NULL) {
+            deferred_task_t *d = *link;
+            bool due = d->due_ns != 0 && now >= d->due_ns;
+            bool readable = d->poll_index >= 0 && fds[d->poll_index].revents != 0;
+            if (due || readable) {
+                *link = d->next;
+                pool.deferred_count--;
+                d->next = ready;
+                ready = d;
+            } else {
+                link = &d->next;
+            }
+        }
+        pthread_mutex_unlock(&pool.deferred_mutex);
+
+        while (ready != NULL) {
+            deferred_task_t *next = ready->next;
+            queue_push_task(&pool.queue, ready->task, ready->arg, false);
+            free(ready);
+            ready = next;
+        }
+    }
+    free(fds);
+    return NULL;
+}
+
+static int waiter_start(void) {
+    pool.deferred = NULL;
+    pool.deferred_count = 0;
+    if (pipe(pool.wake_pipe) != 0) {
+        perror("[ThreadPool] Failed to create wake pipe");
+        return -1;
+    }
+    fcntl(pool.wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(pool.wake_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&pool.deferred_mutex, NULL);
+    pool.waiter_running = true;
+    if (pthread_create(&pool.waiter, NULL, waiter_routine, NULL) != 0) {
+        perror("[ThreadPool] Failed to create waiter thread");
+        pool.waiter_running = false;
+        pthread_mutex_destroy(&pool.deferred_mutex);
+        close(pool.wake_pipe[0]);
+        close(pool.wake_pipe[1]);
+        return -1;
+    }
+    return 0;
+}
+
+// Deferred tasks still parked are dropped: the process is going away
+static void waiter_stop(void) {
+    pthread_mutex_lock(&pool.deferred_mutex);
+    pool.waiter_running = false;
+    pthread_mutex_unlock(&pool.deferred_mutex);
+    if (write(pool.wake_pipe[1], "x", 1) < 0) {
+        perror("[ThreadPool] Failed to wake waiter");
+    }
+    pthread_join(pool.waiter, NULL);
+
+    while (pool.deferred != NULL) {
+        deferred_task_t *next = pool.deferred->next;
+        free(pool.deferred);
+        pool.deferred = next;
+    }
+    pool.deferred_count = 0;
+    pthread_mutex_destroy(&pool.deferred_mutex);
+    close(pool.wake_pipe[0]);
+    close(pool.wake_pipe[1]);
 }
 
 static void *worker_routine(void *arg) {
@@ -113,14 +324,25 @@ static void *worker_routine(void *arg) {
     free(arg); 
     printf("[Worker %d] Started\n", thread_id);
     while (1) {
-        int client_fd = queue_pop(&pool.queue);
-        if (client_fd < 0) {
+        queue_node_t *node = queue_pop(&pool.queue);
+        if (node == NULL) {
            
             printf("[Worker %d] Shutting down\n", thread_id);
             break;
         }
+        if (node->task != NULL) {
+            node->task(node->arg);
+            free(node);
+            continue;
+        }
+        int client_fd = node->client_fd;
+        trace_span_t span = node->span;
+        free(node);
+        trace_stamp(&span, TRACE_DEQUEUED);
+        trace_attach(&span);
         printf("[Worker %d] Processing client fd=%d\n", thread_id, client_fd);
         handle_connection_stub(client_fd);
+        trace_commit();
         printf("[Worker %d] Finished processing client fd=%d\n", 
                thread_id, client_fd);
     }
@@ -142,9 +364,14 @@ int threadpool_init(int num_threads) {
     if (queue_init(&pool.queue, MAX_QUEUE_SIZE) != 0) {
         return -1;
     }
+    if (waiter_start() != 0) {
+        queue_destroy(&pool.queue);
+        return -1;
+    }
     pool.threads = malloc(sizeof(pthread_t) * num_threads);
     if (pool.threads == NULL) {
         perror("[ThreadPool] Failed to allocate thread array");
+        waiter_stop();
         queue_destroy(&pool.queue);
         return -1;
     }
@@ -158,6 +385,7 @@ int threadpool_init(int num_threads) {
                 pthread_join(pool.threads[j], NULL);
             }
             free(pool.threads);
+            waiter_stop();
             queue_destroy(&pool.queue);
             return -1;
         }
@@ -171,6 +399,7 @@ int threadpool_init(int num_threads) {
                 pthread_join(pool.threads[j], NULL);
             }
             free(pool.threads);
+            waiter_stop();
             queue_destroy(&pool.queue);
             return -1;
         }
@@ -180,7 +409,7 @@ int threadpool_init(int num_threads) {
     return 0;
 }
 
-int enqueue_client(int client_file_descriptor) {
+int enqueue_client(int client_file_descriptor, const trace_span_t *span) {
     if (!pool_initialized) {
         fprintf(stderr, "[ThreadPool] Not initialized\n");
         return -1;
@@ -190,7 +419,47 @@ int enqueue_client(int client_file_descriptor) {
         return -1;
     }
     printf("[ThreadPool] Enqueuing client fd=%d\n", client_file_descriptor);
-    return queue_push(&pool.queue, client_file_descriptor);
+    return queue_push(&pool.queue, client_file_descriptor, span);
+}
+
+int threadpool_try_submit(task_fn fn, void *arg) {
+    if (!pool_initialized) {
+        return -1;
+    }
+    return queue_push_task(&pool.queue, fn, arg, true);
+}
+
+int threadpool_defer(task_fn fn, void *arg, int fd, uint64_t delay_ns) {
+    if (!pool_initialized) {
+        return -1;
+    }
+    deferred_task_t *d = malloc(sizeof(deferred_task_t));
+    if (d == NULL) {
+        perror("[ThreadPool] Failed to allocate deferred task");
+        return -1;
+    }
+    d->task = fn;
+    d->arg = arg;
+    d->fd = fd;
+    d->due_ns = (fd < 0 || delay_ns != 0) ? now_ns() + delay_ns : 0;
+    d->poll_index = -1;
+
+    pthread_mutex_lock(&pool.deferred_mutex);
+    if (!pool.waiter_running) {
+        pthread_mutex_unlock(&pool.deferred_mutex);
+        free(d);
+        return -1;
+    }
+    d->next = pool.deferred;
+    pool.deferred = d;
+    pool.deferred_count++;
+    pthread_mutex_unlock(&pool.deferred_mutex);
+
+    // The waiter may be asleep on a longer timeout or without this fd
+    if (write(pool.wake_pipe[1], "x", 1) < 0 && errno != EAGAIN) {
+        perror("[ThreadPool] Failed to wake waiter");
+    }
+    return 0;
 }
 
 void threadpool_shutdown(void) {
@@ -207,6 +476,9 @@ void threadpool_shutdown(void) {
         pthread_join(pool.threads[i], NULL);
         printf("[ThreadPool] Worker %d joined\n", i);
     }
+    // Running tasks may still park themselves: stop the waiter only once no
+    // worker is left to call threadpool_defer
+    waiter_stop();
     free(pool.threads);
     queue_destroy(&pool.queue);
     pool_initialized = false;
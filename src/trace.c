@@ -0,0 +1,325 @@
+// trace.c - Per-request trace spans
+//
+// Only the thread that owns a ring writes to it, so recording takes no
+// locks: each slot carries a sequence number that is odd while the slot is
+// being written, and the dumper skips slots that change under it. Requests
+// that are not sampled cost an id increment and a branch per phase.
+
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifdef TRACE_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, span) DTRACE_PROBE2(webserver, name, (span)->id, (span)->label)
+#else
+#define TRACE_PROBE(name, span) do { (void)(span); } while (0)
+#endif
+
+typedef struct trace_record {
+    atomic_uint seq;
+    trace_span_t span;
+} trace_record_t;
+
+typedef struct trace_ring {
+    int tid;
+    atomic_ulong head;          // spans ever written
+    trace_record_t records[TRACE_RING_SIZE];
+    struct trace_ring *next;
+} trace_ring_t;
+
+static const char *segment_names[TRACE_PHASES] = {
+    "accept", "enqueue", "queue_wait", "parse", "open", "send_headers", "send_body"
+};
+
+static atomic_ulong next_id;
+static atomic_uint sample_every;
+static uint64_t epoch_ns;
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings = NULL;
+static int ring_count = 0;
+
+static pthread_t dump_thread;
+static bool dump_thread_running = false;
+static volatile bool stopping = false;
+
+static __thread trace_span_t *current = NULL;
+static __thread trace_ring_t *thread_ring = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fire_probe(const trace_span_t *span, trace_phase_t phase) {
+    switch (phase) {
+    case TRACE_ACCEPTED:     TRACE_PROBE(accepted, span); break;
+    case TRACE_ENQUEUED:     TRACE_PROBE(enqueued, span); break;
+    case TRACE_DEQUEUED:     TRACE_PROBE(dequeued, span); break;
+    case TRACE_PARSED:       TRACE_PROBE(parsed, span); break;
+    case TRACE_FILE_OPENED:  TRACE_PROBE(file_opened, span); break;
+    case TRACE_HEADERS_SENT: TRACE_PROBE(headers_sent, span); break;
+    case TRACE_LAST_BYTE:    TRACE_PROBE(last_byte, span); break;
+    default: break;
+    }
+}
+
+static trace_ring_t *ring_for_thread(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+    trace_ring_t *ring = calloc(1, sizeof(trace_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&rings_mutex);
+    ring->tid = ++ring_count;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+    thread_ring = ring;
+    return ring;
+}
+
+// Waits for the dump signal; runs on its own thread so the file is written
+// outside signal context
+static void *dump_routine(void *arg) {
+    sigset_t *set = arg;
+    while (1) {
+        int sig;
+        if (sigwait(set, &sig) != 0 || stopping) {
+            break;
+        }
+        FILE *out = fopen(TRACE_DUMP_FILE, "w");
+        if (out == NULL) {
+            perror("[Trace] Failed to open " TRACE_DUMP_FILE);
+            continue;
+        }
+        long spans = trace_dump(out);
+        fclose(out);
+        printf("[Trace] Wrote %ld spans to %s\n", spans, TRACE_DUMP_FILE);
+    }
+    return NULL;
+}
+
+int trace_init(unsigned every) {
+    static sigset_t set;
+
+    atomic_store(&sample_every, every);
+    epoch_ns = now_ns();
+
+    sigemptyset(&set);
+    sigaddset(&set, TRACE_DUMP_SIGNAL);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+        perror("[Trace] Failed to block dump signal");
+        return -1;
+    }
+    if (pthread_create(&dump_thread, NULL, dump_routine, &set) != 0) {
+        perror("[Trace] Failed to start dump thread");
+        return -1;
+    }
+    dump_thread_running = true;
+    printf("[Trace] Sampling 1 in %u requests; kill -USR1 %d writes %s\n",
+           every, (int)getpid(), TRACE_DUMP_FILE);
+    return 0;
+}
+
+void trace_destroy(void) {
+    if (dump_thread_running) {
+        stopping = true;
+        pthread_kill(dump_thread, TRACE_DUMP_SIGNAL);
+        pthread_join(dump_thread, NULL);
+        dump_thread_running = false;
+    }
+    pthread_mutex_lock(&rings_mutex);
+    while (rings != NULL) {
+        trace_ring_t *next = rings->next;
+        free(rings);
+        rings = next;
+    }
+    ring_count = 0;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+void trace_set_sampling(unsigned every) {
+    atomic_store(&sample_every, every);
+}
+
+unsigned trace_get_sampling(void) {
+    return atomic_load(&sample_every);
+}
+
+void trace_begin(trace_span_t *span) {
+    unsigned every = atomic_load_explicit(&sample_every, memory_order_relaxed);
+    span->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed) + 1;
+    span->sampled = every != 0 && span->id % every == 0;
+    memset(span->ts, 0, sizeof(span->ts));
+    span->label[0] = '\0';
+    trace_stamp(span, TRACE_ACCEPTED);
+}
+
+void trace_stamp(trace_span_t *span, trace_phase_t phase) {
+    fire_probe(span, phase);
+    if (!span->sampled || span->ts[phase] != 0) {
+        return;
+    }
+    // A phase reached after a later one (say, a background cache refill
+    // after the response went out) belongs to someone else's timeline
+    for (int p = phase + 1; p < TRACE_PHASES; p++) {
+        if (span->ts[p] != 0) {
+            return;
+        }
+    }
+    span->ts[phase] = now_ns();
+}
+
+void trace_attach(trace_span_t *span) {
+    current = span;
+}
+
+void trace_mark(trace_phase_t phase) {
+    if (current != NULL) {
+        trace_stamp(current, phase);
+    }
+}
+
+void trace_label(const char *method, const char *path) {
+    if (current != NULL) {
+        snprintf(current->label, sizeof(current->label), "%s %s", method, path);
+    }
+}
+
+void trace_commit(void) {
+    trace_span_t *span = current;
+    current = NULL;
+    if (span == NULL || !span->sampled) {
+        return;
+    }
+    trace_ring_t *ring = ring_for_thread();
+    if (ring == NULL) {
+        return;
+    }
+
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_record_t *rec = &ring->records[head % TRACE_RING_SIZE];
+    unsigned seq = atomic_load_explicit(&rec->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&rec->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    rec->span = *span;
+    atomic_store_explicit(&rec->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_detach(trace_span_t *out) {
+    if (current != NULL) {
+        *out = *current;
+    } else {
+        memset(out, 0, sizeof(*out));
+    }
+    current = NULL;
+}
+
+// Copies a slot, or returns false if it was being rewritten meanwhile
+static bool read_record(trace_record_t *rec, trace_span_t *out) {
+    unsigned before = atomic_load_explicit(&rec->seq, memory_order_acquire);
+    if (before & 1) {
+        return false;
+    }
+    memcpy(out, &rec->span, sizeof(*out));
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&rec->seq, memory_order_relaxed) == before;
+}
+
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static double trace_us(uint64_t ns) {
+    return (ns - epoch_ns) / 1000.0;
+}
+
+// The wait for a worker overlaps other requests, so it is an async slice;
+// everything after dequeue nests under one request slice on the worker.
+static void write_span(FILE *out, int tid, const trace_span_t *s) {
+    const char *name = s->label[0] ? s->label : "request";
+    uint64_t start = s->ts[TRACE_DEQUEUED];
+    int last = -1;
+    for (int p = 0; p < TRACE_PHASES; p++) {
+        if (s->ts[p] != 0) last = p;
+    }
+
+    if (s->ts[TRACE_ACCEPTED] != 0 && start != 0) {
+        fprintf(out, ",\n{\"name\":\"queue_wait\",\"cat\":\"queue\",\"ph\":\"b\",\"id\":%llu,"
+                "\"ts\":%.3f,\"pid\":1,\"tid\":0}",
+                (unsigned long long)s->id, trace_us(s->ts[TRACE_ACCEPTED]));
+        fprintf(out, ",\n{\"name\":\"queue_wait\",\"cat\":\"queue\",\"ph\":\"e\",\"id\":%llu,"
+                "\"ts\":%.3f,\"pid\":1,\"tid\":0}",
+                (unsigned long long)s->id, trace_us(start));
+    }
+    if (start == 0 || last <= TRACE_DEQUEUED) {
+        return;
+    }
+
+    fprintf(out, ",\n{\"name\":");
+    json_string(out, name);
+    fprintf(out, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":1,\"tid\":%d,\"args\":{\"id\":%llu}}",
+            trace_us(start), (s->ts[last] - start) / 1000.0, tid, (unsigned long long)s->id);
+
+    uint64_t prev = start;
+    for (int p = TRACE_PARSED; p < TRACE_PHASES; p++) {
+        if (s->ts[p] == 0) {
+            continue;
+        }
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%.3f,"
+                "\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                segment_names[p], trace_us(prev), (s->ts[p] - prev) / 1000.0, tid);
+        prev = s->ts[p];
+    }
+}
+
+long trace_dump(FILE *out) {
+    long spans = 0;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+            "\"args\":{\"name\":\"accept queue\"}}");
+
+    pthread_mutex_lock(&rings_mutex);
+    for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}", ring->tid, ring->tid);
+
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        unsigned long first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (unsigned long i = first; i < head; i++) {
+            trace_span_t span;
+            if (read_record(&ring->records[i % TRACE_RING_SIZE], &span)) {
+                write_span(out, ring->tid, &span);
+                spans++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    fprintf(out, "\n]}\n");
+    return spans;
+}
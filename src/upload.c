@@ -0,0 +1,435 @@
+// upload.c - Streaming request bodies (POST/PUT uploads)
+//
+// Memory per upload is one UPLOAD_BUFFER no matter how large the body is.
+// On Linux, Content-Length bodies are spliced socket -> pipe -> file so the
+// data never passes through user space. A body lands in a hidden temporary
+// file first; only a complete body is renamed to its final name, so readers
+// never see a partial upload.
+
+#define _GNU_SOURCE
+#include "upload.h"
+#include "handler.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static char upload_dir[256] = UPLOAD_DEFAULT_DIR;
+static uint64_t upload_limit = UPLOAD_DEFAULT_MAX;
+static atomic_ulong name_counter;
+
+int upload_init(const char *dir, uint64_t max_bytes) {
+    snprintf(upload_dir, sizeof(upload_dir), "%s", dir);
+    upload_limit = max_bytes;
+
+    if (mkdir(upload_dir, 0755) != 0 && errno != EEXIST) {
+        perror("[Upload] Failed to create upload directory");
+        return -1;
+    }
+    printf("[Upload] Storing uploads in %s/ (limit %llu bytes)\n",
+           upload_dir, (unsigned long long)upload_limit);
+    return 0;
+}
+
+uint64_t upload_max_bytes(void) {
+    return upload_limit;
+}
+
+int upload_parse_request(const char *head, upload_request_t *req) {
+    char value[128];
+    memset(req, 0, sizeof(*req));
+
+    if (handler_find_header(head, "Transfer-Encoding", value, sizeof(value))) {
+        if (strcasecmp(value, "chunked") != 0) {
+            return 501;
+        }
+        req->chunked = true;
+    }
+    if (handler_find_header(head, "Content-Length", value, sizeof(value))) {
+        char *end;
+        errno = 0;
+        req->content_length = strtoull(value, &end, 10);
+        if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno != 0) {
+            return 400;
+        }
+        req->has_length = true;
+    }
+    // Both framings at once is how request smuggling starts
+    if (req->chunked && req->has_length) {
+        return 400;
+    }
+    if (!req->chunked && !req->has_length) {
+        return 411;
+    }
+    if (req->has_length && req->content_length > upload_limit) {
+        return 413;
+    }
+    if (handler_find_header(head, "Expect", value, sizeof(value))) {
+        if (strcasecmp(value, "100-continue") != 0) {
+            return 417;
+        }
+        req->expect_continue = true;
+    }
+    return 0;
+}
+
+// ================================
+// Body decoding
+// ================================
+
+int body_reader_init(body_reader_t *r, int fd, const upload_request_t *req,
+                     const char *initial, size_t initial_len) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->chunked = req->chunked;
+    r->remaining = req->chunked ? 0 : req->content_length;
+    r->buf = malloc(UPLOAD_BUFFER);
+    if (r->buf == NULL || initial_len > UPLOAD_BUFFER) {
+        free(r->buf);
+        r->buf = NULL;
+        return -1;
+    }
+    memcpy(r->buf, initial, initial_len);
+    r->buf_len = initial_len;
+    return 0;
+}
+
+void body_reader_free(body_reader_t *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+// Appends more socket data behind what is buffered; -1 on EOF or error
+static int fill(body_reader_t *r) {
+    if (r->buf_pos > 0) {
+        memmove(r->buf, r->buf + r->buf_pos, r->buf_len - r->buf_pos);
+        r->buf_len -= r->buf_pos;
+        r->buf_pos = 0;
+    }
+    if (r->buf_len == UPLOAD_BUFFER) {
+        errno = EBADMSG;
+        return -1;
+    }
+    ssize_t n = recv(r->fd, r->buf + r->buf_len, UPLOAD_BUFFER - r->buf_len, 0);
+    if (n <= 0) {
+        if (n == 0) errno = EBADMSG;   // body cut short
+        return -1;
+    }
+    r->buf_len += n;
+    return 0;
+}
+
+// Reads one CRLF-terminated line (chunk size or trailer) without the CRLF
+static int read_line(body_reader_t *r, char *line, size_t cap) {
+    while (1) {
+        char *start = r->buf + r->buf_pos;
+        char *nl = memchr(start, '\n', r->buf_len - r->buf_pos);
+        if (nl != NULL) {
+            size_t len = nl - start;
+            if (len > 0 && start[len - 1] == '\r') len--;
+            if (len >= cap) {
+                errno = EBADMSG;
+                return -1;
+            }
+            memcpy(line, start, len);
+            line[len] = '\0';
+            r->buf_pos += nl - start + 1;
+            return 0;
+        }
+        if (r->buf_len - r->buf_pos >= UPLOAD_LINE_MAX || fill(r) != 0) {
+            if (r->buf_len - r->buf_pos >= UPLOAD_LINE_MAX) errno = EBADMSG;
+            return -1;
+        }
+    }
+}
+
+// Moves to the next chunk's data; returns 1 at the last chunk
+static int next_chunk(body_reader_t *r) {
+    char line[UPLOAD_LINE_MAX];
+
+    if (r->chunk_end) {
+        if (read_line(r, line, sizeof(line)) != 0) return -1;
+        if (line[0] != '\0') {
+            errno = EBADMSG;
+            return -1;
+        }
+        r->chunk_end = false;
+    }
+    if (read_line(r, line, sizeof(line)) != 0) return -1;
+
+    uint64_t size = 0;
+    int digits = 0;
+    for (const char *p = line; *p != '\0' && *p != ';' && *p != ' ' && *p != '\t'; p++, digits++) {
+        int v = (*p >= '0' && *p <= '9') ? *p - '0' :
+                (*p >= 'a' && *p <= 'f') ? *p - 'a' + 10 :
+                (*p >= 'A' && *p <= 'F') ? *p - 'A' + 10 : -1;
+        if (v < 0 || digits >= 15) {
+            errno = EBADMSG;
+            return -1;
+        }
+        size = size << 4 | v;
+    }
+    if (digits == 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (size > 0) {
+        r->remaining = size;
+        return 0;
+    }
+
+    // Last chunk: skip trailers up to the blank line
+    do {
+        if (read_line(r, line, sizeof(line)) != 0) return -1;
+    } while (line[0] != '\0');
+    return 1;
+}
+
+ssize_t body_read(body_reader_t *r, char *out, size_t cap) {
+    if (r->done) {
+        return 0;
+    }
+    if (r->remaining == 0) {
+        int rc = r->chunked ? next_chunk(r) : 1;
+        if (rc < 0) return -1;
+        if (rc == 1) {
+            r->done = true;
+            return 0;
+        }
+    }
+
+    size_t want = cap < r->remaining ? cap : (size_t)r->remaining;
+    ssize_t n;
+    if (r->buf_pos < r->buf_len) {
+        n = r->buf_len - r->buf_pos;
+        if ((size_t)n > want) n = want;
+        memcpy(out, r->buf + r->buf_pos, n);
+        r->buf_pos += n;
+    } else {
+        // Nothing buffered: receive straight into the caller's buffer
+        n = recv(r->fd, out, want, 0);
+        if (n <= 0) {
+            if (n == 0) errno = EBADMSG;
+            return -1;
+        }
+    }
+    r->remaining -= n;
+    r->total += n;
+    if (r->chunked && r->remaining == 0) {
+        r->chunk_end = true;
+    }
+    return n;
+}
+
+// ================================
+// Storing
+// ================================
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+// Moves len body bytes socket -> pipe -> file inside the kernel.
+// Returns 0 when done, -1 on error, 1 if splice is not supported here
+// (nothing has been consumed in that case).
+static int splice_body(int sock, int file, uint64_t len) {
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        return 1;
+    }
+    int rc = 0;
+    bool moved = false;
+    while (len > 0) {
+        size_t want = len < UPLOAD_BUFFER ? (size_t)len : UPLOAD_BUFFER;
+        ssize_t in = splice(sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && !moved && (errno == EINVAL || errno == ENOSYS)) {
+            rc = 1;
+            break;
+        }
+        if (in <= 0) {
+            if (in == 0) errno = EBADMSG;
+            rc = -1;
+            break;
+        }
+        moved = true;
+        len -= in;
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, file, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                rc = -1;
+                goto done;
+            }
+            in -= out;
+        }
+    }
+done:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return rc;
+}
+#endif
+
+// Copies the body through the reader's fixed buffer
+static int copy_body(body_reader_t *r, int file) {
+    char *chunk = malloc(UPLOAD_BUFFER);
+    if (chunk == NULL) {
+        return -1;
+    }
+    ssize_t n;
+    int rc = 0;
+    while ((n = body_read(r, chunk, UPLOAD_BUFFER)) > 0) {
+        if (r->total > upload_limit) {
+            errno = EFBIG;
+            rc = -1;
+            break;
+        }
+        if (write_all(file, chunk, n) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (n < 0) rc = -1;
+    free(chunk);
+    return rc;
+}
+
+static int status_for_errno(int err) {
+    switch (err) {
+    case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+    case EWOULDBLOCK:
+#endif
+        return 408;
+    case EFBIG:  return 413;
+    case ENOSPC: return 507;
+    case EBADMSG:
+    case ECONNRESET:
+        return 400;
+    default:     return 500;
+    }
+}
+
+int upload_receive(int fd, const char *name, bool replace, const upload_request_t *req,
+                   const char *initial, size_t initial_len, uint64_t *stored) {
+    char final_path[512], temp_path[512];
+    snprintf(final_path, sizeof(final_path), "%s/%s", upload_dir, name);
+    snprintf(temp_path, sizeof(temp_path), "%s/.%s.XXXXXX", upload_dir, name);
+    *stored = 0;
+
+    if (!replace && access(final_path, F_OK) == 0) {
+        return 409;
+    }
+
+    struct timeval timeout = { UPLOAD_IDLE_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int file = mkstemp(temp_path);
+    if (file < 0) {
+        perror("[Upload] Failed to create temporary file");
+        return 500;
+    }
+    fchmod(file, 0644);
+    trace_mark(TRACE_FILE_OPENED);
+
+    body_reader_t reader;
+    if (body_reader_init(&reader, fd, req, initial, initial_len) != 0) {
+        close(file);
+        unlink(temp_path);
+        return 500;
+    }
+
+    int rc = 0;
+#ifdef __linux__
+    if (!req->chunked) {
+        // Bytes that arrived with the headers go first, the rest is spliced
+        size_t early = initial_len < req->content_length ? initial_len : (size_t)req->content_length;
+        rc = write_all(file, initial, early);
+        if (rc == 0) {
+            rc = splice_body(fd, file, req->content_length - early);
+            if (rc == 1) {
+                reader.buf_pos = early;
+                reader.remaining -= early;
+                reader.total = early;
+                rc = copy_body(&reader, file);
+            } else if (rc == 0) {
+                reader.total = req->content_length;
+            }
+        }
+    } else
+#endif
+    {
+        rc = copy_body(&reader, file);
+    }
+    int err = errno;
+    uint64_t total = reader.total;
+    body_reader_free(&reader);
+
+    if (close(file) != 0 && rc == 0) {
+        err = errno;
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(temp_path);
+        return status_for_errno(err);
+    }
+
+    // PUT replaces atomically; POST links so an existing file is never clobbered
+    bool existed = access(final_path, F_OK) == 0;
+    if (replace) {
+        rc = rename(temp_path, final_path);
+    } else {
+        rc = link(temp_path, final_path);
+        err = errno;
+        unlink(temp_path);
+        errno = err;
+    }
+    if (rc != 0) {
+        int status = errno == EEXIST ? 409 : 500;
+        if (status == 500) perror("[Upload] Failed to move upload into place");
+        unlink(temp_path);
+        return status;
+    }
+
+    *stored = total;
+    printf("[Upload] Stored %llu bytes as %s\n", (unsigned long long)total, final_path);
+    return existed ? 200 : 201;
+}
+
+bool upload_valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= UPLOAD_NAME_MAX || name[0] == '.') {
+        return false;
+    }
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        bool safe = (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                    (*p >= '0' && *p <= '9') || *p == '.' || *p == '_' || *p == '-';
+        if (!safe) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void upload_generate_name(char *out, size_t size) {
+    unsigned long n = atomic_fetch_add(&name_counter, 1) + 1;
+    snprintf(out, size, "upload-%ld-%d-%lu", (long)time(NULL), (int)getpid(), n);
+}
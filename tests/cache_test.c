@@ -0,0 +1,187 @@
+//
+// cache_test.c — response cache coalescing + eviction test
+// N threads miss on the same key at once; the fill must run exactly once.
+// Then N threads read a stale entry: all get the stale copy and exactly one
+// is asked to refresh it.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cache.h"
+
+#define THREAD_COUNT 16
+
+static int fill_calls = 0;
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int slow_fill(void *arg, char **data, size_t *len) {
+    const char *body = arg;
+    pthread_mutex_lock(&fill_lock);
+    fill_calls++;
+    pthread_mutex_unlock(&fill_lock);
+    usleep(200000); // 0.2 sec simulated disk read
+    *data = strdup(body);
+    *len = strlen(body);
+    return 1;
+}
+
+static int sized_fill(void *arg, char **data, size_t *len) {
+    size_t size = *(size_t *)arg;
+    *data = calloc(1, size);
+    *len = size;
+    return 1;
+}
+
+static int versions = 0;
+
+static int versioned_fill(void *arg, char **data, size_t *len) {
+    (void)arg;
+    char body[16];
+    pthread_mutex_lock(&fill_lock);
+    snprintf(body, sizeof(body), "v%d", ++versions);
+    pthread_mutex_unlock(&fill_lock);
+    *data = strdup(body);
+    *len = strlen(body);
+    return 1;
+}
+
+typedef struct stale_read {
+    cache_entry_t *entry;
+    bool revalidate;
+} stale_read_t;
+
+static void *stale_reader(void *arg) {
+    stale_read_t *r = arg;
+    r->entry = cache_get("GET /swr", versioned_fill, NULL, &r->revalidate);
+    return NULL;
+}
+
+static bool entry_is(const cache_entry_t *e, const char *body) {
+    return e != NULL && e->len == strlen(body) && memcmp(e->data, body, e->len) == 0;
+}
+
+// Past its ttl but within the stale window, an entry is served as is while
+// exactly one reader refreshes it; later reads get the refreshed copy
+static int check_stale_while_revalidate(void) {
+    cache_destroy();
+    if (cache_init(1000, 1, 30) != 0) {
+        return -1;
+    }
+    bool revalidate;
+    cache_release(cache_get("GET /swr", versioned_fill, NULL, &revalidate));
+    sleep(2);
+
+    pthread_t threads[THREAD_COUNT];
+    stale_read_t reads[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_create(&threads[i], NULL, stale_reader, &reads[i]);
+    }
+    cache_entry_t *refresh = NULL;
+    int stale_copies = 0, refreshers = 0;
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        if (entry_is(reads[i].entry, "v1")) stale_copies++;
+        if (reads[i].revalidate) {
+            refreshers++;
+            refresh = reads[i].entry;
+        } else {
+            cache_release(reads[i].entry);
+        }
+    }
+    if (refresh != NULL) {
+        cache_revalidate(refresh, versioned_fill, NULL);
+        cache_release(refresh);
+    }
+
+    cache_stats_t before, after;
+    cache_get_stats(&before);
+    cache_entry_t *e = cache_get("GET /swr", versioned_fill, NULL, &revalidate);
+    bool refreshed = entry_is(e, "v2") && !revalidate;
+    cache_release(e);
+    cache_get_stats(&after);
+
+    printf("[Main] stale reads=%d/%d refreshers=%d fills=%d stale_hits=%lu\n",
+           stale_copies, THREAD_COUNT, refreshers, versions, before.stale_hits);
+    if (stale_copies != THREAD_COUNT || refreshers != 1 || before.stale_hits != THREAD_COUNT) {
+        printf("[Error] Stale entry not served while one reader revalidates\n");
+        return -1;
+    }
+    if (!refreshed || versions != 2 || after.hits != before.hits + 1) {
+        printf("[Error] Refreshed entry not served after revalidation\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void* worker(void* arg) {
+    int *ok = arg;
+    bool revalidate;
+    cache_entry_t *e = cache_get("GET /index.html", slow_fill, "hello", &revalidate);
+    *ok = e != NULL && e->len == 5 && memcmp(e->data, "hello", 5) == 0;
+    cache_release(e);
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[THREAD_COUNT];
+    int ok[THREAD_COUNT];
+    int failures = 0;
+
+    if (cache_init(1000, 60, 60) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("[Main] Launching %d concurrent misses on one key...\n", THREAD_COUNT);
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &ok[i]) != 0) {
+            perror("[Error] pthread_create failed");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+        if (!ok[i]) failures++;
+    }
+
+    cache_stats_t stats;
+    cache_get_stats(&stats);
+    printf("[Main] fill calls=%d misses=%lu coalesced=%lu hits=%lu\n",
+           fill_calls, stats.misses, stats.coalesced_waits, stats.hits);
+    if (fill_calls != 1 || failures != 0 ||
+        stats.misses + stats.coalesced_waits + stats.hits != THREAD_COUNT) {
+        printf("[Error] Coalescing failed\n");
+        return EXIT_FAILURE;
+    }
+
+    // Fill the cache with 100-byte one-off entries; the memory bound must
+    // hold and a key hit twice (protected) must survive the scan.
+    size_t size = 100;
+    bool revalidate;
+    cache_release(cache_get("GET /hot", sized_fill, &size, &revalidate));
+    cache_release(cache_get("GET /hot", sized_fill, &size, &revalidate));
+    for (int i = 0; i < 50; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "GET /scan%d", i);
+        cache_release(cache_get(key, sized_fill, &size, &revalidate));
+    }
+    cache_get_stats(&stats);
+    unsigned long hits_before = stats.hits;
+    cache_release(cache_get("GET /hot", sized_fill, &size, &revalidate));
+    cache_get_stats(&stats);
+    printf("[Main] bytes=%zu/%zu evictions=%lu\n", stats.bytes, stats.capacity, stats.evictions);
+    if (stats.bytes > stats.capacity || stats.evictions == 0 || stats.hits != hits_before + 1) {
+        printf("[Error] Segmented LRU bound or protection failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (check_stale_while_revalidate() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    cache_destroy();
+    printf("[Main] Cache coalescing, eviction and stale-while-revalidate OK ✅\n");
+    return EXIT_SUCCESS;
+}
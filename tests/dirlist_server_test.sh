@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# dirlist_server_test.sh — directory requests against a running server
+# Checks that encoded paths cannot climb out of public/ and that directory
+# redirects keep the query string and produce a valid Location.
+# Run from the repo root: make test-dirlist-server
+#
+
+SERVER=./bin/server
+URL=http://localhost:8081
+FAILED=0
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "[PASS] $1"
+    else
+        echo "[FAIL] $1 (expected '$3', got '$2')"
+        FAILED=1
+    fi
+}
+
+status() {
+    curl -s --path-as-is -o /dev/null -w "%{http_code}" "$URL$1"
+}
+
+location() {
+    curl -s --path-as-is -o /dev/null -D - "$URL$1" | tr -d '\r' | sed -n 's/^Location: //p'
+}
+
+# A directory next to public/ that must never be reachable
+mkdir -p dirlist_test_secret public/dirlist_test/sub "public/dirlist_test/sp ace"
+mkdir -p "$(printf 'public/dirlist_test/cr\rlf')"
+echo secret > dirlist_test_secret/index.html
+$SERVER > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf dirlist_test_secret public/dirlist_test' EXIT
+sleep 1
+
+check "listing" "$(status /dirlist_test/)" "200"
+check "dot-dot" "$(status /../dirlist_test_secret/)" "403"
+check "encoded dot-dot" "$(status /%2e%2e/dirlist_test_secret/)" "403"
+check "double-encoded dot-dot" "$(status /%252e%252e/dirlist_test_secret/)" "404"
+check "double-encoded dot-dot below a directory" \
+      "$(status /dirlist_test/%252e%252e/%252e%252e/dirlist_test_secret/)" "404"
+
+check "redirect" "$(location /dirlist_test)" "/dirlist_test/"
+check "redirect keeps the query" "$(location '/dirlist_test?format=json')" "/dirlist_test/?format=json"
+check "redirect is encoded" "$(location '/dirlist_test/sp%20ace')" "/dirlist_test/sp%20ace/"
+check "control characters stay encoded" "$(location '/dirlist_test/cr%0dlf')" "/dirlist_test/cr%0Dlf/"
+check "redirect re-encodes" "$(location '/dirlist_test/sp%20a%63e')" "/dirlist_test/sp%20ace/"
+
+exit $FAILED
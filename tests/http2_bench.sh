@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# http2_bench.sh — many-small-assets page load, HTTP/1.1 vs HTTP/2
+# Generates ASSETS small files under public/bench, then fetches all of them
+# as a browser would: HTTP/1.1 over 6 parallel connections (one request per
+# connection here), and HTTP/2 multiplexed over a single connection.
+# Run from the repo root: make bench-http2
+#
+
+SERVER=./bin/server
+URL=http://localhost:8081
+ASSETS=${ASSETS:-200}
+ROUNDS=${ROUNDS:-5}
+
+mkdir -p public/bench
+i=0
+urls=""
+outs=""
+while [ $i -lt $ASSETS ]; do
+    printf '.asset-%d { color: #%06x; }\n' $i $i > public/bench/asset_$i.css
+    urls="$urls $URL/bench/asset_$i.css"
+    outs="$outs -o /dev/null"
+    i=$((i + 1))
+done
+
+$SERVER > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf public/bench' EXIT
+sleep 1
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+run() {
+    label=$1
+    shift
+    best=""
+    r=0
+    while [ $r -lt $ROUNDS ]; do
+        start=$(now_ms)
+        "$@" > /dev/null 2>&1
+        elapsed=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ $elapsed -lt $best ]; then
+            best=$elapsed
+        fi
+        r=$((r + 1))
+    done
+    printf '%-34s %6d ms (best of %d, %d assets)\n' "$label" "$best" "$ROUNDS" "$ASSETS"
+}
+
+echo "Page load: $ASSETS small assets"
+run "HTTP/1.1, sequential" curl -s --http1.1 $urls $outs
+run "HTTP/1.1, 6 parallel connections" curl -s --http1.1 --parallel --parallel-max 6 $urls $outs
+run "HTTP/2 (h2c), 1 connection" curl -s --http2 --parallel --parallel-max 100 $urls $outs
+if command -v nghttp > /dev/null 2>&1; then
+    run "HTTP/2 (nghttp), 1 connection" nghttp -n $urls
+fi
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# http2_interop_test.sh — HTTP/2 interop test against local clients
+# Runs curl (prior knowledge + h2c upgrade) and nghttp (multiplexed streams)
+# against a freshly started server. Run from the repo root: make test-http2
+#
+
+SERVER=./bin/server
+URL=http://localhost:8081
+FAILED=0
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "[PASS] $1"
+    else
+        echo "[FAIL] $1 (expected '$3', got '$2')"
+        FAILED=1
+    fi
+}
+
+$SERVER > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null' EXIT
+sleep 1
+
+# A stream the client never opens a window for must not hold the connection
+# past the idle timeout (H2_IDLE_TIMEOUT_MS): it gets GOAWAY like an idle one.
+# SETTINGS_INITIAL_WINDOW_SIZE=0, then GET / on stream 1; checked at the end.
+(printf 'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n\000\000\006\004\000\000\000\000\000\000\004\000\000\000\000'
+ printf '\000\000\003\001\005\000\000\000\001\202\206\204'; sleep 33) |
+    curl -s -m 36 telnet://localhost:8081 > /tmp/h2_zero_window 2>/dev/null &
+ZERO_WINDOW_PID=$!
+
+# Prior knowledge: the client opens with the HTTP/2 preface
+out=$(curl -s --http2-prior-knowledge -o /tmp/h2_index -w "%{http_version} %{http_code}" $URL/)
+check "prior knowledge GET /" "$out" "2 200"
+cmp -s /tmp/h2_index public/index.html
+check "prior knowledge body matches" "$?" "0"
+
+# h2c upgrade: HTTP/1.1 request with Upgrade: h2c, answered on stream 1
+out=$(curl -s --http2 -o /tmp/h2_about -w "%{http_version} %{http_code}" $URL/about.html)
+check "upgrade GET /about.html" "$out" "2 200"
+cmp -s /tmp/h2_about public/about.html
+check "upgrade body matches" "$?" "0"
+
+out=$(curl -s --http2-prior-knowledge -o /dev/null -w "%{http_version} %{http_code}" $URL/missing.html)
+check "prior knowledge 404" "$out" "2 404"
+
+out=$(curl -s --http2-prior-knowledge -X POST -o /dev/null -w "%{http_version} %{http_code}" $URL/)
+check "prior knowledge 405" "$out" "2 405"
+
+# Many streams on one connection, served concurrently by the pool
+out=$(curl -s --http2 --parallel --parallel-max 20 \
+      $URL/ $URL/about.html $URL/readme.txt $URL/index.html \
+      -o /dev/null -o /dev/null -o /dev/null -o /dev/null \
+      -w "%{http_version}%{http_code} " 2>/dev/null | tr -d ' ')
+check "upgrade + parallel streams" "$out" "2200220022002200"
+
+if command -v nghttp > /dev/null 2>&1; then
+    out=$(nghttp -n -s $URL/ $URL/about.html $URL/readme.txt $URL/missing.html \
+          | awk '$1 ~ /^[0-9]+$/ {print $5}' | sort | tr '\n' ' ')
+    check "nghttp multiplexed streams" "$out" "200 200 200 404 "
+
+    # Tiny flow-control windows force many WINDOW_UPDATE round trips
+    out=$(nghttp -n -w 10 -W 12 -s $URL/index.html $URL/about.html \
+          | awk '$1 ~ /^[0-9]+$/ {print $5}' | tr '\n' ' ')
+    check "nghttp small windows" "$out" "200 200 "
+else
+    echo "[SKIP] nghttp not installed"
+fi
+
+# HTTP/1.1 keeps working next to HTTP/2
+out=$(curl -s --http1.1 -o /dev/null -w "%{http_version} %{http_code}" $URL/)
+check "HTTP/1.1 GET /" "$out" "1.1 200"
+
+# Idle connections are parked, not served by a worker each: hold more of
+# them open than the pool has workers and HTTP/1.1 must still get through
+for i in 1 2 3 4 5 6; do
+    (printf 'PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n\000\000\000\004\000\000\000\000\000'; sleep 3) |
+        curl -s telnet://localhost:8081 > /dev/null 2>&1 &
+done
+sleep 1
+elapsed=$(curl -s -m 10 -o /dev/null -w "%{time_total}" $URL/)
+out=$(awk -v t="$elapsed" 'BEGIN { print (t < 0.5) ? "yes" : "no" }')
+check "HTTP/1.1 served next to idle HTTP/2 connections (${elapsed}s)" "$out" "yes"
+
+wait $ZERO_WINDOW_PID
+out=$(od -An -tx1 -v /tmp/h2_zero_window | tr -d '\n' | grep -c ' 00 00 08 07 00 00 00 00')
+check "zero-window stream closed with GOAWAY after idle timeout" "$out" "1"
+
+rm -f /tmp/h2_index /tmp/h2_about /tmp/h2_zero_window
+exit $FAILED
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# ratelimit_server_test.sh — rate limits against a running server
+# Loopback is exempt from limiting, so requests go to this host's first
+# non-loopback address; the test is skipped when there is none. Also checks
+# that throttled downloads wait without holding pool workers and that
+# /__trace is refused to remote clients.
+# Run from the repo root: make test-ratelimit-server
+#
+
+SERVER=./bin/server
+ADDR=$(hostname -I 2>/dev/null | tr ' ' '\n' | grep -v ':' | grep -v '^127\.' | head -n 1)
+FAILED=0
+
+if [ -z "$ADDR" ]; then
+    echo "[SKIP] No non-loopback IPv4 address to test from"
+    exit 0
+fi
+URL=http://$ADDR:8081
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "[PASS] $1"
+    else
+        echo "[FAIL] $1 (expected '$3', got '$2')"
+        FAILED=1
+    fi
+}
+
+status() {
+    curl -s --path-as-is -o /dev/null -w "%{http_code}" "$URL$1"
+}
+
+BIG=public/ratelimit_test.bin
+DOWNLOADS=6                 # more than the pool has workers
+dd if=/dev/zero of=$BIG bs=1M count=4 status=none
+
+$SERVER > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -f $BIG /tmp/ratelimit_test_*' EXIT
+sleep 1
+
+# Trace dumps and the sampling switch are for loopback only
+check "remote /__trace" "$(status /__trace)" "403"
+check "remote /__trace?sample=1" "$(status '/__trace?sample=1')" "403"
+check "remote /%5f%5ftrace" "$(status /%5f%5ftrace)" "403"
+out=$(curl -s --http2-prior-knowledge -o /dev/null -w "%{http_code}" $URL/__trace)
+check "remote /__trace over HTTP/2" "$out" "403"
+out=$(curl -s -o /dev/null -w "%{http_code}" http://localhost:8081/__trace)
+check "loopback /__trace" "$out" "200"
+
+# /__stats allows a burst of 10; spend it, then try to get around the rule
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    status /__stats > /dev/null
+done
+check "rule applies" "$(status /__stats)" "429"
+check "percent-encoded path" "$(status /%5f%5fstats)" "429"
+check "repeated slashes" "$(status //__stats)" "429"
+check "query string" "$(status '/__stats?x=1')" "429"
+check "other paths unaffected" "$(status /index.html)" "200"
+
+# One client saturates the pool with throttled downloads (24 MB at its
+# 8 MB/s); another client must still be answered right away
+for i in $(seq $DOWNLOADS); do
+    curl -s -o /tmp/ratelimit_test_$i -w "%{time_total}" $URL/ratelimit_test.bin \
+         > /tmp/ratelimit_test_time_$i &
+    PIDS="$PIDS $!"
+done
+sleep 0.5
+elapsed=$(curl -s -o /dev/null -w "%{time_total}" http://localhost:8081/index.html)
+fast=$(awk -v t="$elapsed" 'BEGIN { print (t < 0.5) ? "yes" : "no" }')
+check "other client served during throttled downloads (${elapsed}s)" "$fast" "yes"
+wait $PIDS
+
+slowest=$(for f in /tmp/ratelimit_test_time_*; do cat $f; echo; done | sort -n | tail -n 1)
+paced=$(awk -v t="$slowest" 'BEGIN { print (t > 2.0) ? "yes" : "no" }')
+check "downloads were paced (${slowest}s)" "$paced" "yes"
+intact=yes
+for i in $(seq $DOWNLOADS); do
+    cmp -s $BIG /tmp/ratelimit_test_$i || intact=no
+done
+check "downloads complete" "$intact" "yes"
+
+exit $FAILED
@@ -0,0 +1,182 @@
+//
+// ratelimit_test.c — token bucket fairness test
+// A heavy client hammers the limiter from several threads while a light
+// client makes a modest number of requests. The heavy one must be held to
+// its rate and the light one must not notice it.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "ratelimit.h"
+
+#define HEAVY_IP        0x0A000001      // 10.0.0.1
+#define LIGHT_IP        0x0A000002      // 10.0.0.2
+#define HEAVY_THREADS   4
+#define RUN_SECONDS     2.0
+#define RPS             50
+#define BURST           10
+#define BPS             (1024 * 1024)
+#define BYTE_BURST      (64 * 1024)
+#define HEAVY_SEND      (64 * 1024)
+#define LIGHT_SEND      (16 * 1024)
+
+typedef struct client_result {
+    long admitted;
+    long rejected;
+    long bytes;
+    double max_wait;
+    long send_size;
+} client_result_t;
+
+static client_result_t heavy[HEAVY_THREADS];
+static client_result_t light;
+static double started;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Ignores Retry-After and sends as fast as it is allowed to; half of its
+// threads download large files, the other half fire bodiless requests
+static void *heavy_client(void *arg) {
+    client_result_t *r = arg;
+    while (now_seconds() - started < RUN_SECONDS) {
+        if (ratelimit_admit(HEAVY_IP, "/big.bin") != 0) {
+            r->rejected++;
+            usleep(1000);
+            continue;
+        }
+        r->admitted++;
+        if (r->send_size > 0) {
+            ratelimit_sleep(ratelimit_pace(HEAVY_IP, "/big.bin", r->send_size));
+        }
+        r->bytes += r->send_size;
+    }
+    return NULL;
+}
+
+// Twenty small requests a second, well inside its limits
+static void *light_client(void *arg) {
+    client_result_t *r = arg;
+    while (now_seconds() - started < RUN_SECONDS) {
+        if (ratelimit_admit(LIGHT_IP, "/index.html") != 0) {
+            r->rejected++;
+        } else {
+            r->admitted++;
+            uint64_t wait = ratelimit_pace(LIGHT_IP, "/index.html", LIGHT_SEND);
+            if (wait / 1e9 > r->max_wait) r->max_wait = wait / 1e9;
+            ratelimit_sleep(wait);
+            r->bytes += LIGHT_SEND;
+        }
+        usleep(50000);
+    }
+    return NULL;
+}
+
+static int check_path_rule(void) {
+    ratelimit_rule_t api = { "/api/", 5, 5, 0, 0 };
+    if (ratelimit_add_rule(&api) != 0) {
+        return -1;
+    }
+
+    // 10.0.0.3 gets five /api/ calls, then must wait; other paths still pass
+    for (int i = 0; i < 5; i++) {
+        if (ratelimit_admit(0x0A000003, "/api/items") != 0) {
+            printf("[Error] /api/ request %d refused too early\n", i + 1);
+            return -1;
+        }
+    }
+    int retry_after = ratelimit_admit(0x0A000003, "/api/items");
+    if (retry_after < 1) {
+        printf("[Error] Sixth /api/ request was admitted\n");
+        return -1;
+    }
+    if (ratelimit_admit(0x0A000003, "/index.html") != 0) {
+        printf("[Error] Path rule leaked onto other paths\n");
+        return -1;
+    }
+    printf("[Main] Path rule: sixth /api/ request refused, Retry-After %d\n", retry_after);
+    return 0;
+}
+
+int main(void) {
+    ratelimit_rule_t per_ip = { "", RPS, BURST, BPS, BYTE_BURST };
+    if (ratelimit_init(&per_ip, false) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    pthread_t threads[HEAVY_THREADS + 1];
+    started = now_seconds();
+    for (int i = 0; i < HEAVY_THREADS; i++) {
+        heavy[i].send_size = (i % 2 == 0) ? HEAVY_SEND : 0;
+        pthread_create(&threads[i], NULL, heavy_client, &heavy[i]);
+    }
+    pthread_create(&threads[HEAVY_THREADS], NULL, light_client, &light);
+    for (int i = 0; i <= HEAVY_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - started;
+
+    client_result_t total = {0, 0, 0, 0, 0};
+    for (int i = 0; i < HEAVY_THREADS; i++) {
+        total.admitted += heavy[i].admitted;
+        total.rejected += heavy[i].rejected;
+        total.bytes += heavy[i].bytes;
+    }
+
+    double heavy_rate = total.bytes / elapsed;
+    double light_rate = light.bytes / elapsed;
+    printf("[Main] Heavy: %ld admitted, %ld refused, %.0f KB/s\n",
+           total.admitted, total.rejected, heavy_rate / 1024);
+    printf("[Main] Light: %ld admitted, %ld refused, %.0f KB/s, longest wait %.3fs\n",
+           light.admitted, light.rejected, light_rate / 1024, light.max_wait);
+
+    int failures = 0;
+
+    // The heavy client gets its rate plus the initial burst and no more
+    double allowed_bytes = BPS * RUN_SECONDS + BYTE_BURST + HEAVY_THREADS * HEAVY_SEND;
+    if (total.bytes > allowed_bytes * 1.1) {
+        printf("[Error] Heavy client exceeded its bandwidth\n");
+        failures++;
+    }
+    if (total.admitted > (RPS * RUN_SECONDS + BURST) * 1.1 + HEAVY_THREADS) {
+        printf("[Error] Heavy client exceeded its request rate\n");
+        failures++;
+    }
+    if (total.rejected == 0) {
+        printf("[Error] Heavy client was never refused\n");
+        failures++;
+    }
+
+    // The light client is unaffected by its noisy neighbour
+    if (light.rejected != 0 || light.max_wait > 0) {
+        printf("[Error] Light client was throttled\n");
+        failures++;
+    }
+    if (light.admitted < RUN_SECONDS * 20 * 0.8) {
+        printf("[Error] Light client made too few requests\n");
+        failures++;
+    }
+
+    if (check_path_rule() != 0) {
+        failures++;
+    }
+
+    ratelimit_stats_t stats;
+    ratelimit_get_stats(&stats);
+    printf("[Main] Limiter: %lu admitted, %lu refused, %lu paced sends, %lu buckets\n",
+           stats.admitted, stats.rejected, stats.paced, stats.entries);
+    ratelimit_destroy();
+
+    if (failures) {
+        return EXIT_FAILURE;
+    }
+    printf("[Main] Heavy client held to its limits, light client unaffected ✅\n");
+    return EXIT_SUCCESS;
+}
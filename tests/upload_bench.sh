@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# upload_bench.sh — upload throughput and memory
+# Uploads a SIZE_MB file with PUT (Content-Length, spliced to disk on Linux)
+# and with chunked POST, checks the stored copies, and reports throughput
+# and the server's peak RSS, which should not grow with the upload size.
+# Run from the repo root: make bench-upload
+#
+
+SERVER=./bin/server
+URL=http://localhost:8081
+SIZE_MB=${SIZE_MB:-2048}
+SOURCE=/tmp/upload_bench_$$.bin
+
+dd if=/dev/zero of=$SOURCE bs=1M count=$SIZE_MB status=none
+
+$SERVER > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -f $SOURCE uploads/bench_put.bin uploads/bench_chunked.bin' EXIT
+sleep 1
+
+peak_rss_kb() {
+    awk '/VmHWM/ { print $2 }' /proc/$SERVER_PID/status 2>/dev/null || echo "?"
+}
+
+failures=0
+
+run() {
+    label=$1
+    name=$2
+    shift 2
+    result=$(curl -s -o /dev/null -w '%{http_code} %{time_total} %{speed_upload}' "$@")
+    set -- $result
+    mb_s=$(awk -v s="$3" 'BEGIN { printf "%.0f", s / 1048576 }')
+    printf '%-30s %s  %6.2f s  %5s MB/s  peak RSS %s KB\n' "$label" "$1" "$2" "$mb_s" "$(peak_rss_kb)"
+    if [ "$1" != "201" ] && [ "$1" != "200" ] || ! cmp -s $SOURCE uploads/$name; then
+        echo "[FAIL] $label: stored file does not match"
+        failures=$((failures + 1))
+    fi
+}
+
+echo "Upload: $SIZE_MB MB (server peak RSS before: $(peak_rss_kb) KB)"
+run "PUT, Content-Length" bench_put.bin -T $SOURCE $URL/upload/bench_put.bin
+run "POST, chunked" bench_chunked.bin -X POST -H "Transfer-Encoding: chunked" \
+    -T $SOURCE $URL/upload/bench_chunked.bin
+
+[ $failures -eq 0 ]
@@ -0,0 +1,88 @@
+#!/bin/sh
+#
+# upload_test.sh — upload names, body framing and limits
+# Names with control characters, CRLF or path syntax must be refused with
+# 400 before anything is written, and must never reach a response header.
+# Then the body decoding and refusal statuses, with a 1 KB upload limit.
+# Run from the repo root: make test-upload
+#
+
+SERVER=./bin/server
+URL=http://localhost:8081
+FAILED=0
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "[PASS] $1"
+    else
+        echo "[FAIL] $1 (expected '$3', got '$2')"
+        FAILED=1
+    fi
+}
+
+# put <path> [body file] [curl options]
+put() {
+    path=$1
+    body=${2:-/tmp/upload_test_body}
+    shift
+    [ $# -gt 0 ] && shift
+    curl -s --path-as-is -o /dev/null -D /tmp/upload_test_headers -w "%{http_code}" \
+         -T "$body" "$@" "$URL$path"
+}
+
+# Sends a raw request (printf format) and prints the response status code
+raw() {
+    (printf "$1"; sleep 1) | curl -s -m 3 telnet://localhost:8081 | head -1 | awk '{print $2}'
+}
+
+echo "upload test" > /tmp/upload_test_body
+echo "other body" > /tmp/upload_test_other
+head -c 2048 /dev/zero > /tmp/upload_test_big
+rm -f uploads/upload_test*
+UPLOAD_MAX_BYTES=1024 $SERVER > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; rm -f /tmp/upload_test_body /tmp/upload_test_other /tmp/upload_test_big /tmp/upload_test_headers uploads/upload_test*' EXIT
+sleep 1
+
+check "CRLF in name" "$(put '/upload/a%0d%0aSet-Cookie:%20x=1')" "400"
+grep -qi '^Set-Cookie' /tmp/upload_test_headers
+check "no injected header" "$?" "1"
+check "control character in name" "$(put '/upload/a%01b')" "400"
+check "space in name" "$(put '/upload/a%20b')" "400"
+check "encoded slash in name" "$(put '/upload/..%2fsrc%2fmain.c')" "400"
+check "leading dot" "$(put '/upload/.hidden')" "400"
+ls uploads 2>/dev/null | grep -q 'Set-Cookie'
+check "nothing stored for rejected names" "$?" "1"
+
+check "safe name" "$(put '/upload/upload_test.txt')" "201"
+location=$(tr -d '\r' < /tmp/upload_test_headers | sed -n 's/^Location: //p')
+check "Location header" "$location" "/upload/upload_test.txt"
+cmp -s /tmp/upload_test_body uploads/upload_test.txt
+check "stored body matches" "$?" "0"
+
+# Chunk extensions are skipped and trailers read past, not stored
+out=$(raw 'PUT /upload/upload_test_chunked.txt HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n5;name=value\r\nhello\r\n7 ; a="b"\r\n, world\r\n0\r\nX-Checksum: abc\r\nX-Other: 1\r\n\r\n')
+check "chunked body with extensions and trailers" "$out" "201"
+check "chunked body decoded" "$(cat uploads/upload_test_chunked.txt 2>/dev/null)" "hello, world"
+
+out=$(raw 'PUT /upload/upload_test_smuggle.txt HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n')
+check "Content-Length with Transfer-Encoding" "$out" "400"
+check "no body length" "$(curl -s -o /dev/null -w "%{http_code}" -X PUT $URL/upload/upload_test_none.txt)" "411"
+
+check "POST new name" "$(curl -s -o /dev/null -w "%{http_code}" -X POST -T /tmp/upload_test_body $URL/upload/upload_test_post.txt)" "201"
+check "POST over existing file" "$(curl -s -o /dev/null -w "%{http_code}" -X POST -T /tmp/upload_test_other $URL/upload/upload_test_post.txt)" "409"
+cmp -s /tmp/upload_test_body uploads/upload_test_post.txt
+check "existing file kept" "$?" "0"
+
+# Over the limit: refused from Content-Length up front, or while a chunked body streams in
+check "Content-Length over limit" "$(put '/upload/upload_test_big.txt' /tmp/upload_test_big)" "413"
+check "chunked body over limit" "$(put '/upload/upload_test_big.txt' /tmp/upload_test_big -H 'Transfer-Encoding: chunked')" "413"
+check "nothing stored over limit" "$(ls -A uploads | grep -c upload_test_big)" "0"
+
+check "Expect: 100-continue" "$(put '/upload/upload_test_expect.txt' '' -H 'Expect: 100-continue')" "201"
+check "100 Continue sent first" "$(tr -d '\r' < /tmp/upload_test_headers | grep '^HTTP/' | awk '{print $2}' | tr '\n' ' ')" "100 201 "
+check "Expect: 100-continue over limit" "$(put '/upload/upload_test_big.txt' /tmp/upload_test_big -H 'Expect: 100-continue')" "413"
+check "no 100 Continue over limit" "$(grep -c '^HTTP/1.1 100' /tmp/upload_test_headers)" "0"
+check "unknown expectation" "$(put '/upload/upload_test_expect.txt' '' -H 'Expect: magic')" "417"
+
+exit $FAILED